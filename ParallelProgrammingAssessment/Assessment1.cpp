@@ -1,5 +1,83 @@
 #include <iostream>
 #include "ImageProcessor.h"
+#include "Benchmark.h"
+#include "BatchProcessor.h"
+#include "EqualisationService.h"
+#include "MultiDeviceProcessor.h"
+#include "TiledProcessor.h"
+#include "VideoStream.h"
+//runs every kernel variant on a single image -- shared by the 8 and 16 bit paths
+template<typename CIMG_TYPE>
+void RunAllKernels(int platform_id, int device_id, int workgroup_size, int num_bins, int vector_width, std::string& image_filename, std::string& kernel_folder, bool profilingEnabled, bool ignoreColour, bool showGraphs, ScanMethod scanMethod, bool specialiseSize)
+{
+	ImageProcessor<CIMG_TYPE> processor(platform_id, device_id, workgroup_size, num_bins, vector_width, image_filename, kernel_folder, profilingEnabled, ignoreColour, showGraphs, specialiseSize);
+	GlobalKernel      <CIMG_TYPE> G;
+	LocalKernel       <CIMG_TYPE> L;
+	GridStrideKernel  <CIMG_TYPE> GS;
+	VectorGlobalKernel<CIMG_TYPE> VG;
+	VectorLocalKernel <CIMG_TYPE> VL;
+	ReplicatedKernel  <CIMG_TYPE> R;
+	HighBinKernel     <CIMG_TYPE> HB;
+	ColourFusedKernel <CIMG_TYPE> CF;
+	FusedKernel       <CIMG_TYPE> F;
+	ChannelQueuesKernel<CIMG_TYPE> CQ;
+	for (ImageProcessorKernel<CIMG_TYPE>* kernel : std::initializer_list<ImageProcessorKernel<CIMG_TYPE>*>{ &G, &L, &GS, &VG, &VL, &R, &HB, &CQ }) {
+		kernel->SetScanMethod(scanMethod);
+	}
+	processor.AddKernel(&G);
+	processor.AddKernel(&VG);
+	//these keep every bin in local memory, which rules them out for very high bin counts (e.g. -h -b 65536)
+	if (processor.FitsInLocalMemory(sizeof(LOCAL_HIST_TYPE) * num_bins)) {
+		processor.AddKernel(&L);
+		processor.AddKernel(&GS);
+		processor.AddKernel(&VL);
+		processor.AddKernel(&R);
+		processor.AddKernel(&CF);
+		processor.AddKernel(&CQ);
+	}
+	else {
+		std::cout << "Skipping local histogram kernels, " << num_bins << " bins do not fit in local memory" << std::endl;
+	}
+	processor.AddKernel(&HB);
+	if (processor.FitsInLocalMemory(FusedKernel<CIMG_TYPE>::LocalMemorySize(num_bins, workgroup_size, processor.HistSize()))) {
+		processor.AddKernel(&F);
+	}
+	processor.RunAll();
+	processor.DisplayImages();
+}
+
+//two pass tiled run for images bigger than the device's largest buffer
+template<typename CIMG_TYPE>
+void RunTiled(int platform_id, int device_id, int workgroup_size, int num_bins, size_t tile_pixels, std::string& image_filename, std::string& kernel_folder, bool ignoreColour)
+{
+	CImg::CImg<CIMG_TYPE> inputImage(image_filename.c_str());
+	CImg::CImg<CIMG_TYPE> outputImage(inputImage.width(), inputImage.height(), inputImage.depth(), inputImage.spectrum());
+	ImageTileSource<CIMG_TYPE> source(inputImage, ignoreColour);
+	ImageTileSink<CIMG_TYPE> sink(outputImage, source.Channels());
+	TiledProcessor<CIMG_TYPE>(platform_id, device_id, workgroup_size, num_bins, tile_pixels, kernel_folder).Run(source, sink);
+	outputImage.save(("equalized_" + image_filename).c_str());
+}
+//tiled mode straight from and to the files, a band of band_rows rows at a time, for images that do not fit in host memory either
+template<typename CIMG_TYPE>
+void RunStreamed(int platform_id, int device_id, int workgroup_size, int num_bins, size_t band_rows, std::string& image_filename, std::string& kernel_folder, bool ignoreColour)
+{
+	PnmFileSource<CIMG_TYPE> source;
+	if (!source.Open(image_filename)) {
+		std::cout << "Streaming mode (-R) needs a binary PGM/PPM file with " << sizeof(CIMG_TYPE) * 8 << " bit samples (16 bit with -h)" << std::endl;
+		return;
+	}
+	if (source.Header().Channels() > 1 && !ignoreColour) {
+		std::cout << "Streaming mode (-R) keeps colour interleaved, so the channels have to be pooled (-c)" << std::endl;
+		return;
+	}
+	PnmFileSink<CIMG_TYPE> sink;
+	if (!sink.Create("equalized_" + image_filename, source.Header().Equalised())) {
+		std::cout << "Could not create equalized_" << image_filename << std::endl;
+		return;
+	}
+	TiledProcessor<CIMG_TYPE>(platform_id, device_id, workgroup_size, num_bins, band_rows * source.Header().RowSamples(), kernel_folder).Run(source, sink);
+}
+
 int main(int argc, char** argv)
 {
 	//process arguments
@@ -7,54 +85,124 @@ int main(int argc, char** argv)
 	int device_id = 0;
 	int workgroup_size = 256;
 	int num_bins = 256;
+	int vector_width = 0;
 	bool highDepth = false;
 	bool ignoreColour = false;
 	std::string image_filename = "test.pgm";
 	std::string kernel_folder = "kernels";
 	bool profilingEnabled = true;
 	bool showGraphs = false;
+	bool runBenchmark = false;
+	bool specialiseSize = false;
+	std::string batch_path = "";
+	std::string output_folder = "equalized";
+	std::string socket_path = "";
+	std::string device_list = "";
+	size_t tile_pixels = 0;
+	size_t band_rows = 0;
+	std::string video_format = "";
+	double cdf_alpha = 1.0;
+	int histogram_every = 1;
+	ScanMethod scanMethod = ScanMethod::Default;
 	for (int i = 1; i < argc; i++) {
 		if      ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
 		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
 		else if ((strcmp(argv[i], "-w") == 0) && (i < (argc - 1))) { workgroup_size = atoi(argv[++i]); }
 		else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { num_bins = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-v") == 0) && (i < (argc - 1))) {
+			vector_width = atoi(argv[++i]);
+			//VEC_WIDTH builds the vload/vstore names, anything OpenCL has no vector type for breaks the whole program build
+			if (vector_width != 2 && vector_width != 3 && vector_width != 4 && vector_width != 8 && vector_width != 16) {
+				std::cout << "Unsupported vector width: " << argv[i] << " (2/3/4/8/16)" << std::endl;
+				return 0;
+			}
+		}
 		else if ((strcmp(argv[i], "-i") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; }
 		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { kernel_folder = argv[++i]; }
+		else if ((strcmp(argv[i], "-m") == 0) && (i < (argc - 1))) { batch_path = argv[++i]; }
+		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output_folder = argv[++i]; }
+		else if ((strcmp(argv[i], "-S") == 0) && (i < (argc - 1))) { socket_path = argv[++i]; }
+		else if ((strcmp(argv[i], "-M") == 0) && (i < (argc - 1))) { device_list = argv[++i]; }
+		else if ((strcmp(argv[i], "-T") == 0) && (i < (argc - 1))) { tile_pixels = strtoull(argv[++i], nullptr, 10); }
+		else if ((strcmp(argv[i], "-R") == 0) && (i < (argc - 1))) { band_rows = strtoull(argv[++i], nullptr, 10); }
+		else if ((strcmp(argv[i], "-V") == 0) && (i < (argc - 1))) { video_format = argv[++i]; }
+		else if ((strcmp(argv[i], "-E") == 0) && (i < (argc - 1))) { cdf_alpha = atof(argv[++i]); }
+		else if ((strcmp(argv[i], "-K") == 0) && (i < (argc - 1))) { histogram_every = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-s") == 0) && (i < (argc - 1))) {
+			i++;
+			if      (strcmp(argv[i], "default") == 0) { scanMethod = ScanMethod::Default; }
+			else if (strcmp(argv[i], "blelloch") == 0) { scanMethod = ScanMethod::Blelloch; }
+			else { std::cout << "Unknown scan method: " << argv[i] << std::endl; return 0; }
+		}
 		else if ((strcmp(argv[i], "-t") == 0					)) { profilingEnabled = false; }
 		else if ((strcmp(argv[i], "-h") == 0					)) { highDepth = true; }
 		else if ((strcmp(argv[i], "-g") == 0					)) { showGraphs = true; }
 		else if ((strcmp(argv[i], "-c") == 0					)) { ignoreColour = true; }
+		else if ((strcmp(argv[i], "-B") == 0					)) { runBenchmark = true; }
+		else if ((strcmp(argv[i], "-F") == 0					)) { specialiseSize = true; }
 		else if ((strcmp(argv[i], "-l") == 0					)) { std::cout << Utils::ListPlatformsDevices() << std::endl; return 0; }
 		else if ((strcmp(argv[i], "-h") == 0                    )) { Utils::print_help(); return 0; }
 		else													   { std::cout << "Unknown option: " << argv[i] << std::endl; return 0; }
 	}
+	//video frames go to stdout, so everything else goes to stderr
+	if (!video_format.empty()) std::cout.rdbuf(std::cerr.rdbuf());
 	std::cout
 		<< "Running on " << Utils::GetPlatformName(platform_id) << ", " << Utils::GetDeviceName(platform_id, device_id) << "\n"
-		<< "Workgroup size: " << workgroup_size << "  Number of Bins: " << num_bins << "\n"
+		<< "Workgroup size: " << workgroup_size << "  Number of Bins: " << num_bins << "  Vector width: " << (vector_width > 0 ? std::to_string(vector_width) : "auto") << "\n"
+		<< "Scan method: " << (scanMethod == ScanMethod::Blelloch ? "blelloch" : "default") << "\n"
 		<< "Colour channels " << (ignoreColour ? "ignored" : "calculated separately") << "\n"
-		<< "Image: " << image_filename << "    Processed as " << (highDepth ? "high bit depth (16)" : "low bit depth (8)") << "\n"
+		<< (!socket_path.empty() ? "Service: " + socket_path : batch_path.empty() ? "Image: " + image_filename : "Batch: " + batch_path + " -> " + output_folder) << "    Processed as " << (highDepth ? "high bit depth (16)" : "low bit depth (8)") << "\n"
 		<< "Profiling " << (profilingEnabled ? "enabled" : "disabled") << "  Graphs " << (showGraphs ? "shown" : "hidden") << "\n"
 		<< std::endl;
 
 	//Run main program 
 	try {
-		if (highDepth) {
-			ImageProcessor<unsigned short> processor(platform_id, device_id, workgroup_size, num_bins, image_filename, kernel_folder, profilingEnabled, ignoreColour,showGraphs);
-			GlobalKernel  <unsigned short> G;
-			LocalKernel   <unsigned short> L;
-			processor.AddKernel(&G);
-			processor.AddKernel(&L);
-			processor.RunAll();
-			processor.DisplayImages();
+		if (runBenchmark) {
+			if (highDepth) Benchmark::RunContentionBenchmark<unsigned short>(platform_id, device_id, workgroup_size, num_bins, vector_width, kernel_folder, 4096, 4096);
+			else           Benchmark::RunContentionBenchmark<unsigned char> (platform_id, device_id, workgroup_size, num_bins, vector_width, kernel_folder, 4096, 4096);
+			Benchmark::RunScanBenchmark<unsigned char>(platform_id, device_id, workgroup_size, vector_width, kernel_folder);
+		}
+		else if (!video_format.empty()) {
+			//the sample size comes from the pixel format rather than -h
+			VideoFormat format;
+			if (!VideoFormat::Parse(video_format, format)) { std::cout << "Unknown video format: " << video_format << std::endl; return 0; }
+			if (format.bytesPerSample == 2) VideoStreamProcessor<unsigned short>(platform_id, device_id, workgroup_size, num_bins, format, kernel_folder, ignoreColour, cdf_alpha, histogram_every).Run();
+			else                            VideoStreamProcessor<unsigned char> (platform_id, device_id, workgroup_size, num_bins, format, kernel_folder, ignoreColour, cdf_alpha, histogram_every).Run();
+		}
+		else if (band_rows > 0) {
+			if (highDepth) RunStreamed<unsigned short>(platform_id, device_id, workgroup_size, num_bins, band_rows, image_filename, kernel_folder, ignoreColour);
+			else           RunStreamed<unsigned char> (platform_id, device_id, workgroup_size, num_bins, band_rows, image_filename, kernel_folder, ignoreColour);
+		}
+		else if (tile_pixels > 0) {
+			if (highDepth) RunTiled<unsigned short>(platform_id, device_id, workgroup_size, num_bins, tile_pixels, image_filename, kernel_folder, ignoreColour);
+			else           RunTiled<unsigned char> (platform_id, device_id, workgroup_size, num_bins, tile_pixels, image_filename, kernel_folder, ignoreColour);
+		}
+		else if (!device_list.empty()) {
+			std::vector<std::pair<int, int>> device_ids = MultiDeviceProcessor<unsigned char>::ParseDevices(device_list);
+			if (highDepth) {
+				MultiDeviceProcessor<unsigned short> processor(device_ids, workgroup_size, num_bins, image_filename, kernel_folder, ignoreColour);
+				processor.Run();
+				processor.Save();
+			}
+			else {
+				MultiDeviceProcessor<unsigned char> processor(device_ids, workgroup_size, num_bins, image_filename, kernel_folder, ignoreColour);
+				processor.Run();
+				processor.Save();
+			}
+		}
+		else if (!socket_path.empty()) {
+			if (highDepth) EqualisationService<unsigned short>(platform_id, device_id, workgroup_size, num_bins, vector_width, kernel_folder, ignoreColour, socket_path).Run();
+			else           EqualisationService<unsigned char> (platform_id, device_id, workgroup_size, num_bins, vector_width, kernel_folder, ignoreColour, socket_path).Run();
+		}
+		else if (!batch_path.empty()) {
+			if (highDepth) BatchProcessor<unsigned short>(platform_id, device_id, workgroup_size, num_bins, vector_width, kernel_folder, ignoreColour, output_folder).Run(BatchProcessor<unsigned short>::ListInputs(batch_path));
+			else           BatchProcessor<unsigned char> (platform_id, device_id, workgroup_size, num_bins, vector_width, kernel_folder, ignoreColour, output_folder).Run(BatchProcessor<unsigned char>::ListInputs(batch_path));
+		}
+		else if (highDepth) {
+			RunAllKernels<unsigned short>(platform_id, device_id, workgroup_size, num_bins, vector_width, image_filename, kernel_folder, profilingEnabled, ignoreColour, showGraphs, scanMethod, specialiseSize);
 		}
 		else {
-			ImageProcessor<unsigned char> processor(platform_id, device_id, workgroup_size, num_bins, image_filename, kernel_folder, profilingEnabled,ignoreColour,showGraphs);
-			GlobalKernel  <unsigned char> G;
-			LocalKernel   <unsigned char> L;
-			processor.AddKernel(&G);
-			processor.AddKernel(&L);
-			processor.RunAll();
-			processor.DisplayImages();
+			RunAllKernels<unsigned char>(platform_id, device_id, workgroup_size, num_bins, vector_width, image_filename, kernel_folder, profilingEnabled, ignoreColour, showGraphs, scanMethod, specialiseSize);
 		}
 	}
 	//Display error and exit on all thrown OpenCL and CImage exceptions
@@ -66,6 +214,10 @@ int main(int argc, char** argv)
 		std::cerr << "ERROR: " << err.what() << std::endl;
 		exit(1);
 	}
+	catch (const std::runtime_error& err) {
+		std::cerr << "ERROR: " << err.what() << std::endl;
+		exit(1);
+	}
 	return 0;
 }
 
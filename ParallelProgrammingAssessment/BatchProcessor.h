@@ -0,0 +1,162 @@
+#pragma once
+#include "ImageProcessor.h"
+#include <map>
+#include <set>
+#include <memory>
+#include <algorithm>
+#include <cctype>
+//batch mode (-m) -- equalises every image in a directory or list file and saves the results to an output folder
+//one context is kept for the whole batch and the work is rotated over a few slots, each with its own queue and device buffers,
+//so while one image's kernels run the next image is being uploaded and the previous one downloaded (and saved by the host)
+//device buffers come from a DevicePool, so images of mixed sizes reuse each other's buffers rather than each slot growing its own
+
+template<typename CIMG_TYPE>
+class BatchProcessor
+{
+public:
+	BatchProcessor(int platform_id, int device_id, int _workgroup_size, int _num_bins, int _vector_width, std::string& kernel_folder, bool _ignoreColour, std::string& _output_folder)
+		:workgroup_size(_workgroup_size),
+		num_bins(_num_bins),
+		vector_width(_vector_width > 0 ? _vector_width : 16 / sizeof(CIMG_TYPE)),
+		ignoreColour(_ignoreColour),
+		output_folder(_output_folder)
+	{
+		context = Utils::GetContext(platform_id, device_id);
+		pool = DevicePool(context);
+		Utils::AddAllSources(sources, kernel_folder);
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		//same rule as the single image mode -- the local pipeline unless its histogram does not fit in local memory
+		bool local = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() >= sizeof(LOCAL_HIST_TYPE) * num_bins;
+		for (Slot& slot : slots) {
+			slot.queue = cl::CommandQueue(context);
+			if (local) slot.kernel = std::make_unique<LocalKernel<CIMG_TYPE>>();
+			else       slot.kernel = std::make_unique<HighBinKernel<CIMG_TYPE>>();
+		}
+		std::cout << "Batch kernel: " << slots[0].kernel->GetName() << ", " << slotCount << " slots" << std::endl;
+	}
+	virtual ~BatchProcessor() {}
+public:
+	//every image file in a directory (sorted), or every line of a list file
+	static std::vector<std::string> ListInputs(const std::string& path) {
+		std::vector<std::string> files;
+		if (std::filesystem::is_directory(path)) {
+			for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(path)) {
+				if (!entry.is_regular_file()) continue;
+				std::string extension = entry.path().extension().string();
+				std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+				if (extension == ".pgm" || extension == ".ppm" || extension == ".pnm" || extension == ".png" || extension == ".jpg" || extension == ".jpeg" || extension == ".bmp")
+					files.push_back(entry.path().string());
+			}
+			std::sort(files.begin(), files.end());
+			return files;
+		}
+		std::ifstream list(path);
+		if (list.fail()) {
+			std::cout << "Failed to open batch list " << path << std::endl;
+			exit(1);
+		}
+		std::string line;
+		while (std::getline(list, line)) {
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			if (!line.empty()) files.push_back(line);
+		}
+		return files;
+	}
+
+	void Run(const std::vector<std::string>& files) {
+		std::filesystem::create_directories(output_folder);
+		size_t processed = 0;
+		size_t pixels = 0;
+		std::chrono::time_point start = std::chrono::high_resolution_clock::now();
+		for (size_t i = 0; i < files.size(); i++) {
+			Slot& slot = slots[i % slotCount];
+			//the slot's last image has to be finished before its buffers and host images are reused
+			Finish(slot);
+			try {
+				slot.input = CImg::CImg<CIMG_TYPE>(files[i].c_str());
+			}
+			catch (CImg::CImgException& err) {
+				std::cerr << "Skipping " << files[i] << ": " << err.what() << std::endl;
+				continue;
+			}
+			slot.output.assign(slot.input.width(), slot.input.height(), slot.input.depth(), slot.input.spectrum());
+			slot.outputPath = OutputPath(files[i]);
+			Submit(slot);
+			processed++;
+			pixels += slot.input.size();
+		}
+		for (Slot& slot : slots) Finish(slot);
+		std::chrono::time_point end = std::chrono::high_resolution_clock::now();
+
+		double seconds = std::chrono::duration<double>(end - start).count();
+		std::cout
+			<< "\nBatch: " << processed << " of " << files.size() << " images in " << seconds << " s\n"
+			<< "Throughput: " << processed / std::max(seconds, 1e-9) << " images/s, "
+			<< pixels / std::max(seconds, 1e-9) / 1e6 << " Mpixel/s"
+			<< std::endl;
+		pool.Report();
+	}
+protected:
+	//everything one image in flight needs
+	struct Slot {
+		cl::CommandQueue queue;
+		DeviceLease image;
+		std::unique_ptr<ImageProcessorKernel<CIMG_TYPE>> kernel;
+		CImg::CImg<CIMG_TYPE> input;
+		CImg::CImg<CIMG_TYPE> output;
+		std::string outputPath;
+		cl::Event done;
+		bool busy = false;
+	};
+	//three is enough for upload / compute / download to all be in flight at once
+	static const int slotCount = 3;
+
+	//the input's file name in the output folder -- list files can name the same file name in different directories, so a name
+	//already used in this batch gets a numbered suffix instead of overwriting the earlier result
+	std::string OutputPath(const std::string& input) {
+		std::filesystem::path name = std::filesystem::path(input).filename();
+		std::filesystem::path path = std::filesystem::path(output_folder) / name;
+		for (int n = 1; !usedOutputs.insert(path.string()).second; n++) {
+			path = std::filesystem::path(output_folder) / (name.stem().string() + "_" + std::to_string(n) + name.extension().string());
+		}
+		if (path.filename() != name) std::cerr << "Output name " << name.string() << " already used in this batch, saving " << input << " as " << path.string() << std::endl;
+		return path.string();
+	}
+
+	void Submit(Slot& slot) {
+		//the slot's last image has finished (Finish), so its buffers can go back to the pool before this image asks for its own
+		slot.kernel->ReleaseBuffers();
+		slot.image.reset();
+		slot.image = pool.Acquire(slot.input.size() * sizeof(CIMG_TYPE));
+		slot.kernel->Init(GetProgram(slot.input.size()), slot.input, slot.output, slot.queue, slot.image, pool, num_bins, workgroup_size, vector_width, ignoreColour, false);
+		slot.done = slot.kernel->Run(cl::Event());
+		slot.queue.flush(); //start the device on it now rather than when the slot is next waited on
+		slot.busy = true;
+	}
+	void Finish(Slot& slot) {
+		if (!slot.busy) return;
+		slot.done.wait();
+		slot.output.save(slot.outputPath.c_str());
+		slot.busy = false;
+		pool.Trim();
+	}
+	//the image size is a kernel argument, so this only ever builds one program per HIST_TYPE (uint, or ulong for huge images)
+	cl::Program& GetProgram(size_t imageSize) {
+		std::string options = GetBuildOptions<CIMG_TYPE>(num_bins, vector_width, imageSize);
+		auto found = programs.find(options);
+		if (found != programs.end()) return found->second;
+		return programs.emplace(options, BuildProgram(context, sources, options)).first->second;
+	}
+
+	int workgroup_size;
+	int num_bins;
+	int vector_width;
+	bool ignoreColour;
+	std::string output_folder;
+	std::set<std::string> usedOutputs; //output paths already given out this batch
+	cl::Program::Sources sources;
+	cl::Context context;
+	DevicePool pool;
+	std::map<std::string, cl::Program> programs;
+	Slot slots[slotCount];
+};
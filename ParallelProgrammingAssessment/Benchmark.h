@@ -0,0 +1,160 @@
+#pragma once
+#include "ImageProcessor.h"
+#include <random>
+#include <iomanip>
+#include <numeric>
+//synthetic benchmarks for comparing kernel variants on inputs with a known distribution
+//these run instead of the normal single-image program (-B)
+
+namespace Benchmark {
+	//every value equally likely - close to the best case for atomic contention
+	template<typename CIMG_TYPE>
+	CImg::CImg<CIMG_TYPE> UniformImage(int width, int height, unsigned int seed = 1) {
+		CImg::CImg<CIMG_TYPE> image(width, height, 1, 1);
+		std::mt19937 rng(seed);
+		std::uniform_int_distribution<unsigned int> dist(0, (1u << (sizeof(CIMG_TYPE) * 8)) - 1);
+		cimg_for(image, ptr, CIMG_TYPE) { *ptr = (CIMG_TYPE)dist(rng); }
+		return image;
+	}
+	//a single dominant value (a black border / white paper) covering dominantFraction of the pixels, the rest uniform
+	template<typename CIMG_TYPE>
+	CImg::CImg<CIMG_TYPE> SkewedImage(int width, int height, double dominantFraction, unsigned int seed = 1) {
+		CImg::CImg<CIMG_TYPE> image(width, height, 1, 1);
+		std::mt19937 rng(seed);
+		std::uniform_int_distribution<unsigned int> dist(0, (1u << (sizeof(CIMG_TYPE) * 8)) - 1);
+		std::bernoulli_distribution dominant(dominantFraction);
+		cimg_for(image, ptr, CIMG_TYPE) { *ptr = dominant(rng) ? 0 : (CIMG_TYPE)dist(rng); }
+		return image;
+	}
+
+	//histogram stage time of the plain local kernel vs the replicated one, on uniform and increasingly skewed inputs
+	template<typename CIMG_TYPE>
+	void RunContentionBenchmark(int platform_id, int device_id, int workgroup_size, int num_bins, int vector_width, std::string& kernel_folder, int width, int height) {
+		std::cout << "Contention benchmark: " << width << "x" << height << " synthetic images\n" << std::endl;
+		std::vector<std::pair<std::string, CImg::CImg<CIMG_TYPE>>> inputs;
+		inputs.push_back({ "uniform", UniformImage<CIMG_TYPE>(width, height) });
+		for (double fraction : { 0.6, 0.75, 0.9 }) {
+			inputs.push_back({ std::to_string((int)(fraction * 100)) + "% one value", SkewedImage<CIMG_TYPE>(width, height, fraction) });
+		}
+
+		std::stringstream table;
+		table << std::left << std::setw(18) << "input" << std::setw(22) << "local hist [ns]" << std::setw(22) << "replicated hist [ns]" << "speedup" << "\n";
+		for (auto& [name, image] : inputs) {
+			ImageProcessor<CIMG_TYPE> processor(platform_id, device_id, workgroup_size, num_bins, vector_width, image, kernel_folder, true, false, false);
+			LocalKernel     <CIMG_TYPE> L;
+			ReplicatedKernel<CIMG_TYPE> R;
+			processor.AddKernel(&L);
+			processor.AddKernel(&R);
+			std::cout << "Input: " << name << " (" << R.GetReplicas() << " replicas)";
+			processor.RunAll();
+			std::cout << std::endl;
+			table << std::left << std::setw(18) << name << std::setw(22) << L.GetHistogramTime() << std::setw(22) << R.GetHistogramTime()
+				<< std::fixed << std::setprecision(2) << (double)L.GetHistogramTime() / (double)std::max<cl_ulong>(R.GetHistogramTime(), 1) << "x\n";
+		}
+		std::cout << table.str() << std::endl;
+	}
+
+	//correctness and timing of the local accumulate step: the original two kernel scan (AccumulateHistogram_1 + _2)
+	//against the three phase scan (AccumulateHistogram_1 + Blelloch scan of block sums + AccumulateHistogram_3)
+	//and the single pass look-back scan (AccumulateHistogram_LookBack) where the device supports it
+	//all are checked against a prefix sum done on the host
+	template<typename CIMG_TYPE>
+	void RunScanBenchmark(int platform_id, int device_id, int workgroup_size, int vector_width, std::string& kernel_folder) {
+		const int repeats = 5;
+		std::cout << "Scan benchmark: average of " << repeats << " runs\n" << std::endl;
+		std::stringstream table;
+		table << std::left << std::setw(10) << "bins" << std::setw(24) << "two kernel [ns]" << std::setw(24) << "three phase [ns]" << std::setw(24) << "look-back [ns]" << "speedup" << "\n";
+		for (int bins : { 256, 4096, 65536, 1 << 20 }) {
+			//a 1 pixel image is enough to build the program for this bin count (and makes HIST_TYPE uint)
+			ImageProcessor<CIMG_TYPE> processor(platform_id, device_id, workgroup_size, bins, vector_width, CImg::CImg<CIMG_TYPE>(1, 1, 1, 1, 0), kernel_folder, true, false, false);
+			cl::Context& context = processor.GetContext();
+			cl::CommandQueue& queue = processor.GetQueue();
+			cl::Program& program = processor.GetProgram();
+
+			std::vector<uint> histogram(bins);
+			std::mt19937 rng(bins);
+			std::uniform_int_distribution<uint> dist(0, 255); //keeps the total well inside 32 bits at 2^20 bins
+			for (uint& bin : histogram) bin = dist(rng);
+			std::vector<uint> expected(bins);
+			std::partial_sum(histogram.begin(), histogram.end(), expected.begin());
+
+			size_t blocks = bins / workgroup_size + 1;
+			size_t globalSize = blocks * workgroup_size;
+			cl::Buffer A(context, CL_MEM_READ_WRITE, bins * sizeof(uint));
+			cl::Buffer B(context, CL_MEM_READ_WRITE, bins * sizeof(uint));
+			cl::Buffer BlockSums(context, CL_MEM_READ_WRITE, blocks * sizeof(uint));
+
+			cl::Kernel blockScan(program, "AccumulateHistogram_1");
+			blockScan.setArg(0, A);
+			blockScan.setArg(1, B);
+			blockScan.setArg(2, cl::Local(sizeof(uint) * workgroup_size));
+			blockScan.setArg(3, cl::Local(sizeof(uint) * workgroup_size));
+			blockScan.setArg(4, BlockSums);
+			cl::Kernel gather(program, "AccumulateHistogram_2");
+			gather.setArg(0, B);
+			gather.setArg(1, A);
+			cl::Kernel sumsScan(program, "AccumulateHistogram_Blelloch");
+			sumsScan.setArg(0, BlockSums);
+			sumsScan.setArg(1, cl::Local(sizeof(uint) * ScanGroupSize(workgroup_size) * 2));
+			sumsScan.setArg(2, (cl_uint)blocks);
+			cl::Kernel uniformAdd(program, "AccumulateHistogram_3");
+			uniformAdd.setArg(0, B);
+			uniformAdd.setArg(1, BlockSums);
+			uniformAdd.setArg(2, A);
+			bool lookBackSupported = SupportsLookBackScan(program, queue, workgroup_size);
+			cl::Buffer LookBackStatus(context, CL_MEM_READ_WRITE, (blocks + 1) * sizeof(cl_ulong));
+			//the kernel is only in the program on devices with 64 bit atomics (see Local.cl)
+			cl::Kernel lookBack;
+			if (lookBackSupported) {
+				lookBack = cl::Kernel(program, "AccumulateHistogram_LookBack");
+				lookBack.setArg(0, A);
+				lookBack.setArg(1, cl::Local(sizeof(uint) * workgroup_size));
+				lookBack.setArg(2, cl::Local(sizeof(uint) * workgroup_size));
+				lookBack.setArg(3, LookBackStatus);
+			}
+
+			//runs one pipeline, returns its average kernel time and checks the last result
+			enum class Pipeline { TwoKernel, ThreePhase, LookBack };
+			auto timePipeline = [&](Pipeline pipeline, bool& correct) {
+				cl_ulong total = 0;
+				std::vector<uint> result(bins);
+				for (int r = 0; r < repeats; r++) {
+					queue.enqueueWriteBuffer(A, CL_TRUE, 0, bins * sizeof(uint), histogram.data());
+					std::vector<cl::Event> events(pipeline == Pipeline::ThreePhase ? 3 : pipeline == Pipeline::TwoKernel ? 2 : 1);
+					if (pipeline == Pipeline::LookBack) {
+						queue.enqueueFillBuffer<cl_ulong>(LookBackStatus, 0, 0, (blocks + 1) * sizeof(cl_ulong));
+						queue.enqueueNDRangeKernel(lookBack, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(workgroup_size), nullptr, &events[0]);
+					}
+					else {
+						queue.enqueueNDRangeKernel(blockScan, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(workgroup_size), nullptr, &events[0]);
+					}
+					if (pipeline == Pipeline::ThreePhase) {
+						queue.enqueueNDRangeKernel(sumsScan, cl::NullRange, cl::NDRange(ScanGroupSize(workgroup_size)), cl::NDRange(ScanGroupSize(workgroup_size)), nullptr, &events[1]);
+						queue.enqueueNDRangeKernel(uniformAdd, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(workgroup_size), nullptr, &events[2]);
+					}
+					else if (pipeline == Pipeline::TwoKernel) {
+						queue.enqueueNDRangeKernel(gather, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(workgroup_size), nullptr, &events[1]);
+					}
+					queue.enqueueReadBuffer(A, CL_TRUE, 0, bins * sizeof(uint), result.data());
+					for (const cl::Event& event : events) {
+						total += event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+					}
+				}
+				correct = result == expected;
+				return total / repeats;
+			};
+			bool twoKernelCorrect, threePhaseCorrect, lookBackCorrect = false;
+			cl_ulong twoKernelTime = timePipeline(Pipeline::TwoKernel, twoKernelCorrect);
+			cl_ulong threePhaseTime = timePipeline(Pipeline::ThreePhase, threePhaseCorrect);
+			cl_ulong lookBackTime = lookBackSupported ? timePipeline(Pipeline::LookBack, lookBackCorrect) : 0;
+			//speedup is of the fastest single/multi pass scan over the original
+			cl_ulong bestTime = lookBackSupported ? std::min(threePhaseTime, lookBackTime) : threePhaseTime;
+			table << std::left << std::setw(10) << bins
+				<< std::setw(24) << (std::to_string(twoKernelTime) + (twoKernelCorrect ? "" : " (WRONG)"))
+				<< std::setw(24) << (std::to_string(threePhaseTime) + (threePhaseCorrect ? "" : " (WRONG)"))
+				<< std::setw(24) << (lookBackSupported ? std::to_string(lookBackTime) + (lookBackCorrect ? "" : " (WRONG)") : std::string("unsupported"))
+				<< std::fixed << std::setprecision(2) << (double)twoKernelTime / (double)std::max<cl_ulong>(bestTime, 1) << "x\n";
+		}
+		std::cout << table.str() << std::endl;
+	}
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include "Utils.h"
+#include <map>
+#include <memory>
+//pool of device buffers for runs over many images of different sizes (batch and service mode)
+//requests are rounded up to a size class (quarter steps between powers of two), and a buffer goes back to its class when the last lease on it is dropped,
+//so an image of a similar size to one already seen reuses its buffer instead of allocating a new one
+//a lease must not be dropped while commands using it are still queued -- the next image could be given the same buffer
+
+//reference counted -- the buffer returns to the pool when the last copy of the lease goes
+using DeviceLease = std::shared_ptr<cl::Buffer>;
+
+class DevicePool
+{
+public:
+	DevicePool() {}
+	DevicePool(cl::Context& context) :state(std::make_shared<State>()) {
+		state->context = context;
+		state->maxAllocation = context.getInfo<CL_CONTEXT_DEVICES>()[0].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	}
+public:
+	//1, 1.25, 1.5 or 1.75 times a power of two, so a buffer is never more than a quarter bigger than asked for
+	size_t SizeClass(size_t bytes) const {
+		if (bytes <= minimumClass) return minimumClass;
+		size_t power = minimumClass;
+		while (power <= bytes / 2) power <<= 1;
+		size_t step = power / 4;
+		size_t size = ((bytes + step - 1) / step) * step;
+		//rounding must not push a buffer that fits the device past its largest allocation
+		if (size > state->maxAllocation) return bytes;
+		return size;
+	}
+
+	DeviceLease Acquire(size_t bytes) {
+		size_t size = SizeClass(bytes);
+		cl::Buffer buffer;
+		std::vector<cl::Buffer>& idle = state->idle[size];
+		state->acquires++;
+		if (!idle.empty()) {
+			buffer = idle.back();
+			idle.pop_back();
+			state->idleBytes -= size;
+			state->hits++;
+		}
+		else {
+			buffer = cl::Buffer(state->context, CL_MEM_READ_WRITE, size);
+			state->deviceBytes += size;
+			state->peakDeviceBytes = std::max(state->peakDeviceBytes, state->deviceBytes);
+		}
+		state->usedBytes += size;
+		state->windowUsedBytes = std::max(state->windowUsedBytes, state->usedBytes);
+		//the deleter only holds a weak reference, leases that outlive the pool just free their buffer
+		std::weak_ptr<State> owner = state;
+		return DeviceLease(new cl::Buffer(buffer), [owner, size](cl::Buffer* released) {
+			if (std::shared_ptr<State> state = owner.lock()) {
+				state->idle[size].push_back(*released);
+				state->idleBytes += size;
+				state->usedBytes -= size;
+			}
+			delete released;
+		});
+	}
+
+	//high-water-mark trim -- frees idle buffers (largest first) until the pool holds no more than the most that was in use at once
+	//since the last trim, so a one-off large image does not pin its buffers for the rest of the run
+	void Trim() {
+		for (auto sizeClass = state->idle.rbegin(); sizeClass != state->idle.rend(); sizeClass++) {
+			while (!sizeClass->second.empty() && state->deviceBytes > state->windowUsedBytes) {
+				sizeClass->second.pop_back();
+				state->idleBytes -= sizeClass->first;
+				state->deviceBytes -= sizeClass->first;
+			}
+		}
+		state->windowUsedBytes = state->usedBytes;
+	}
+
+	void Report() const {
+		std::cout
+			<< "Device pool: " << state->acquires << " acquires, hit rate "
+			<< (state->acquires > 0 ? 100.0 * state->hits / state->acquires : 0.0) << "%\n"
+			<< "Peak device bytes: " << state->peakDeviceBytes << "  (held now: " << state->deviceBytes << ", idle: " << state->idleBytes << ")"
+			<< std::endl;
+	}
+	size_t GetHits() const { return state->hits; }
+	size_t GetAcquires() const { return state->acquires; }
+	size_t GetPeakDeviceBytes() const { return state->peakDeviceBytes; }
+protected:
+	//small scratch buffers (tickets, block sums) share one class rather than one each
+	static const size_t minimumClass = 4096;
+
+	struct State {
+		cl::Context context;
+		size_t maxAllocation = 0;   //CL_DEVICE_MAX_MEM_ALLOC_SIZE
+		std::map<size_t, std::vector<cl::Buffer>> idle;
+		size_t acquires = 0;
+		size_t hits = 0;
+		size_t deviceBytes = 0;     //allocated by the pool, in use or idle
+		size_t peakDeviceBytes = 0;
+		size_t usedBytes = 0;       //leased out
+		size_t windowUsedBytes = 0; //most leased out at once since the last trim
+		size_t idleBytes = 0;
+	};
+	//shared so leases can find their way back -- copies of a pool are the same pool
+	std::shared_ptr<State> state;
+};
@@ -0,0 +1,308 @@
+#pragma once
+#include "ImageProcessor.h"
+#include <map>
+#include <memory>
+#include <cstring>
+//service mode (-S) -- a long running process that equalises images sent to it over a unix domain socket
+//the context, programs, kernels and device buffers are set up once and kept warm, so a request only costs the copies and the kernels
+//instead of platform enumeration + context creation + program build for every image
+//
+//protocol -- one request per line, any number of requests per connection, each answered before the next is read:
+//  file <input path> <output path> [options]      equalise a file on disk, the result is saved to the output path
+//                                                 -> "ok <microseconds>" or "error <message>"
+//  raw <width> <height> <channels> [options]      followed by width*height*channels samples (8 or 16 bit to match -h),
+//                                                 planar like CImg (all of channel 0, then channel 1...), native byte order
+//                                                 -> "ok <microseconds> <bytes>" followed by that many bytes of equalised samples
+//  quit                                           stops the service
+//options: bins=<n> (default -b, otherwise a power of two up to the sample range), grey (treat colour as one channel, like -c)
+//paths must not contain spaces
+//requests read and write files with the service's permissions, so the socket is created 0600 -- only the user running it can connect
+//e.g. echo "file in.pgm out.pgm bins=1024" | socat - UNIX-CONNECT:/tmp/equalise.sock
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+
+template<typename CIMG_TYPE>
+class EqualisationService
+{
+public:
+	EqualisationService(int platform_id, int device_id, int _workgroup_size, int _num_bins, int _vector_width, std::string& kernel_folder, bool _ignoreColour, std::string& _socket_path)
+		:workgroup_size(_workgroup_size),
+		num_bins(_num_bins),
+		vector_width(_vector_width > 0 ? _vector_width : 16 / sizeof(CIMG_TYPE)),
+		ignoreColour(_ignoreColour),
+		socket_path(_socket_path)
+	{
+		context = Utils::GetContext(platform_id, device_id);
+		Utils::AddAllSources(sources, kernel_folder);
+		queue = cl::CommandQueue(context);
+		pool = DevicePool(context);
+		localMemory = context.getInfo<CL_CONTEXT_DEVICES>()[0].getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+		maxImageBytes = context.getInfo<CL_CONTEXT_DEVICES>()[0].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+		//build the default program up front so the first request does not pay for it
+		GetProgram(num_bins, 1);
+	}
+	virtual ~EqualisationService() {
+		if (listener >= 0) {
+			close(listener);
+			unlink(socket_path.c_str());
+		}
+	}
+public:
+	void Run() {
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener < 0) Fail("socket");
+		sockaddr_un address = {};
+		address.sun_family = AF_UNIX;
+		if (socket_path.size() >= sizeof(address.sun_path)) {
+			std::cout << "Socket path too long: " << socket_path << std::endl;
+			exit(1);
+		}
+		std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+		unlink(socket_path.c_str()); //a stale socket from a previous run would make bind fail
+		//created owner only from the start rather than chmod'ed after, so there is no moment anyone else could connect
+		mode_t previousMask = umask(0177);
+		int bound = bind(listener, (sockaddr*)&address, sizeof(address));
+		umask(previousMask);
+		if (bound < 0) Fail("bind");
+		if (listen(listener, 8) < 0) Fail("listen");
+		std::cout << "Listening on " << socket_path << std::endl;
+
+		//one connection at a time -- there is one queue and one set of buffers, so requests would serialise on the device anyway
+		while (running) {
+			int client = accept(listener, nullptr, nullptr);
+			if (client < 0) {
+				if (errno == EINTR) continue;
+				Fail("accept");
+			}
+			Connection connection(client);
+			std::string line;
+			while (running && connection.ReadLine(line)) {
+				if (!line.empty() && !Handle(connection, line)) break;
+			}
+			close(client);
+		}
+	}
+protected:
+	//buffered reads over a socket, so the request line is not read a byte per recv
+	struct Connection {
+		int fd;
+		std::vector<char> buffer;
+		size_t start = 0;
+		size_t end = 0;
+		Connection(int _fd) :fd(_fd), buffer(1 << 16) {}
+
+		bool Fill() {
+			if (start == end) start = end = 0;
+			if (end == buffer.size()) return true;
+			ssize_t received;
+			do { received = recv(fd, buffer.data() + end, buffer.size() - end, 0); } while (received < 0 && errno == EINTR);
+			if (received <= 0) return false;
+			end += received;
+			return true;
+		}
+		bool ReadLine(std::string& line) {
+			line.clear();
+			while (true) {
+				for (; start < end; start++) {
+					if (buffer[start] == '\n') {
+						start++;
+						if (!line.empty() && line.back() == '\r') line.pop_back();
+						return true;
+					}
+					line.push_back(buffer[start]);
+				}
+				if (!Fill()) return false;
+			}
+		}
+		bool Read(void* destination, size_t bytes) {
+			char* out = (char*)destination;
+			while (bytes > 0) {
+				if (start == end && !Fill()) return false;
+				size_t count = std::min(bytes, end - start);
+				std::memcpy(out, buffer.data() + start, count);
+				out += count;
+				start += count;
+				bytes -= count;
+			}
+			return true;
+		}
+		bool Write(const void* source, size_t bytes) {
+			const char* in = (const char*)source;
+			while (bytes > 0) {
+				ssize_t sent = send(fd, in, bytes, MSG_NOSIGNAL);
+				if (sent < 0 && errno == EINTR) continue;
+				if (sent <= 0) return false;
+				in += sent;
+				bytes -= sent;
+			}
+			return true;
+		}
+		bool WriteLine(const std::string& line) {
+			return Write((line + "\n").data(), line.size() + 1);
+		}
+	};
+
+	struct Request {
+		std::string command;
+		std::vector<std::string> arguments;
+		int num_bins;
+		bool ignoreColour;
+	};
+
+	//false when the connection has to be dropped -- a raw request that fails before its payload is read leaves the payload
+	//in the stream (its length may not even be known), and the next line would be parsed from pixel bytes
+	bool Handle(Connection& connection, const std::string& line) {
+		bool payloadPending = line.compare(0, 4, "raw ") == 0;
+		try {
+			Request request = Parse(line);
+			if (request.command == "quit") {
+				connection.WriteLine("ok");
+				running = false;
+				pool.Report();
+			}
+			else if (request.command == "file" && request.arguments.size() == 2) {
+				input = CImg::CImg<CIMG_TYPE>(request.arguments[0].c_str());
+				long long micros = Equalise(request);
+				output.save(request.arguments[1].c_str());
+				connection.WriteLine("ok " + std::to_string(micros));
+			}
+			else if (request.command == "raw" && request.arguments.size() == 3) {
+				long long width = std::stoll(request.arguments[0]);
+				long long height = std::stoll(request.arguments[1]);
+				long long channels = std::stoll(request.arguments[2]);
+				//bounded before anything is allocated -- no larger than the device could hold in one buffer anyway
+				if (width <= 0 || height <= 0 || channels <= 0 || channels > 4 || width > INT_MAX || height > INT_MAX
+					|| (unsigned long long)width * height > maxImageBytes / (channels * sizeof(CIMG_TYPE)))
+					throw std::invalid_argument("bad image dimensions");
+				input.assign((int)width, (int)height, 1, (int)channels);
+				if (!connection.Read(input.data(), input.size() * sizeof(CIMG_TYPE))) return false;
+				payloadPending = false; //from here on a failed request leaves the connection in step
+				long long micros = Equalise(request);
+				size_t bytes = output.size() * sizeof(CIMG_TYPE);
+				connection.WriteLine("ok " + std::to_string(micros) + " " + std::to_string(bytes));
+				connection.Write(output.data(), bytes);
+			}
+			else {
+				connection.WriteLine("error unknown request: " + line);
+			}
+		}
+		catch (const cl::Error& err) {
+			connection.WriteLine(std::string("error ") + err.what() + ", " + Utils::getErrorString(err.err()));
+		}
+		catch (CImg::CImgException& err) {
+			connection.WriteLine(std::string("error ") + err.what());
+		}
+		catch (const std::exception& err) {
+			connection.WriteLine(std::string("error ") + err.what());
+		}
+		return !payloadPending;
+	}
+	Request Parse(const std::string& line) {
+		Request request{ "", {}, num_bins, ignoreColour };
+		std::stringstream tokens(line);
+		tokens >> request.command;
+		std::string token;
+		while (tokens >> token) {
+			if (token.rfind("bins=", 0) == 0) request.num_bins = std::stoi(token.substr(5));
+			else if (token == "grey") request.ignoreColour = true;
+			else request.arguments.push_back(token);
+		}
+		return request;
+	}
+
+	//runs the input image through the warm kernel, returns the time from upload to download in microseconds
+	long long Equalise(const Request& request) {
+		//every bin count is a program kept for the life of the service, so clients only get the powers of two a sample can fill --
+		//with the two HIST_TYPEs that bounds the cache to a few dozen programs
+		bool powerOfTwo = request.num_bins > 0 && (request.num_bins & (request.num_bins - 1)) == 0;
+		bool inRange = (size_t)request.num_bins <= ((size_t)1 << (sizeof(CIMG_TYPE) * 8));
+		if (request.num_bins <= 0 || (request.num_bins != num_bins && !(powerOfTwo && inRange))) throw std::invalid_argument("bad bin count");
+		output.assign(input.width(), input.height(), input.depth(), input.spectrum());
+		std::chrono::time_point start = std::chrono::high_resolution_clock::now();
+		//the image buffer is kept while images fit its size class, a new one means every kernel has to be bound to it again
+		size_t imageClass = pool.SizeClass(input.size() * sizeof(CIMG_TYPE));
+		if (imageClass != this->imageClass) {
+			image.reset();
+			image = pool.Acquire(imageClass);
+			this->imageClass = imageClass;
+			bufferGeneration++;
+		}
+		cl::Program& program = GetProgram(request.num_bins, input.size());
+		//same rule as the single image mode -- the local pipeline unless its histogram does not fit in local memory
+		bool local = localMemory >= sizeof(LOCAL_HIST_TYPE) * request.num_bins;
+		WarmKernel& warm = local ? localKernel : highBinKernel;
+		if (!warm.kernel) {
+			if (local) warm.kernel = std::make_unique<LocalKernel<CIMG_TYPE>>();
+			else       warm.kernel = std::make_unique<HighBinKernel<CIMG_TYPE>>();
+		}
+		//the image size is a kernel argument, so the kernels only need binding again when the program, buffers or colour handling change
+		if (warm.program != &program || warm.bufferGeneration != bufferGeneration || warm.ignoreColour != request.ignoreColour) {
+			//histograms and scratch come from the pool, so switching bin counts back and forth reuses them
+			warm.kernel->Init(program, input, output, queue, image, pool, request.num_bins, workgroup_size, vector_width, request.ignoreColour, false);
+			warm.program = &program;
+			warm.bufferGeneration = bufferGeneration;
+			warm.ignoreColour = request.ignoreColour;
+		}
+		warm.kernel->Run(cl::Event()).wait();
+		pool.Trim();
+		std::chrono::time_point end = std::chrono::high_resolution_clock::now();
+		return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+	}
+
+	//one program per bin count and HIST_TYPE, built on first use and kept for the life of the service (see Equalise for the bin counts)
+	cl::Program& GetProgram(int bins, size_t imageSize) {
+		std::string options = GetBuildOptions<CIMG_TYPE>(bins, vector_width, imageSize);
+		auto found = programs.find(options);
+		if (found != programs.end()) return found->second;
+		return programs.emplace(options, BuildProgram(context, sources, options)).first->second;
+	}
+
+	void Fail(const char* call) {
+		std::cout << "Service " << call << " failed: " << std::strerror(errno) << std::endl;
+		exit(1);
+	}
+
+	struct WarmKernel {
+		std::unique_ptr<ImageProcessorKernel<CIMG_TYPE>> kernel;
+		cl::Program* program = nullptr;
+		unsigned int bufferGeneration = 0;
+		bool ignoreColour = false;
+	};
+
+	int workgroup_size;
+	int num_bins;
+	int vector_width;
+	bool ignoreColour;
+	std::string socket_path;
+	int listener = -1;
+	bool running = true;
+	size_t localMemory;
+	cl_ulong maxImageBytes;
+	cl::Program::Sources sources;
+	cl::Context context;
+	cl::CommandQueue queue;
+	std::map<std::string, cl::Program> programs;
+	DevicePool pool;
+	DeviceLease image;
+	size_t imageClass = 0;
+	unsigned int bufferGeneration = 0;
+	WarmKernel localKernel;
+	WarmKernel highBinKernel;
+	CImg::CImg<CIMG_TYPE> input;
+	CImg::CImg<CIMG_TYPE> output;
+};
+#else
+//unix domain sockets only -- the service is not built on windows
+template<typename CIMG_TYPE>
+class EqualisationService
+{
+public:
+	EqualisationService(int, int, int, int, int, std::string&, bool, std::string&) {}
+	void Run() { std::cout << "Service mode (-S) is not supported on this platform" << std::endl; }
+};
+#endif
@@ -1,5 +1,8 @@
 #pragma once
 #include "ImageProcessorKernel.h"
+#include "ProgramCache.h"
+#include "MappedPnm.h"
+#include <memory>
 #include <chrono>
 //These exist to allow me to feed in the desired image data type to the CL compiler
 template<typename T>
@@ -22,104 +25,265 @@ std::string GetCLTypename<unsigned int>()
 	return "uint";
 }
 
+//defines the kernels are specialised on -- the program has to be rebuilt for each distinct set
+//the image size is passed to the kernels at run time, so one program serves every image (per HIST_TYPE)
+//channelSize > 0 opts back in to baking the per-channel pixel count in as CHANNEL_SIZE, for when only one size is ever run
+template<typename CIMG_TYPE>
+std::string GetBuildOptions(int num_bins, int vector_width, size_t imageSize, size_t channelSize = 0)
+{
+	std::stringstream compileOptions;
+	compileOptions << "-D NUM_BINS=" << num_bins << " ";
+	compileOptions << "-D BIT_DEPTH=" << sizeof(CIMG_TYPE) * 8 << " ";
+	compileOptions << "-D VEC_WIDTH=" << vector_width << " ";
+	compileOptions << "-D DATA_TYPE=" << GetCLTypename<CIMG_TYPE>() << " ";
+	compileOptions << "-D HIST_TYPE=" << HistTypeName(imageSize) << " ";
+	compileOptions << "-D LOCAL_HIST_TYPE=" << STR(LOCAL_HIST_TYPE) << " ";
+	//offset (where the channel starts) and count (its pixel count) are runtime arguments so one built program serves every image size,
+	//a build specialised on one channel size uses the constant instead so bounds checks fold away
+	//defined here rather than in a .cl file since every file uses it and AddAllSources does not promise a file order
+	if (channelSize > 0) compileOptions << "-D CHANNEL_SIZE=" << channelSize << " -D PIXEL_COUNT(count)=((ulong)CHANNEL_SIZE) ";
+	else                 compileOptions << "-D PIXEL_COUNT(count)=(count) ";
+	return compileOptions.str();
+}
+//host side of the modes that histogram an image in pieces (multi-device, tiled)
+//adds a HIST_TYPE histogram read back from a device (hist_size bytes per bin) into a running total
+inline void AddPartialHistogram(std::vector<unsigned long long>& total, const std::vector<unsigned char>& partial, size_t hist_size)
+{
+	for (size_t bin = 0; bin < total.size(); bin++) {
+		if (hist_size == sizeof(ulong)) total[bin] += ((const ulong*)partial.data())[bin];
+		else                            total[bin] += ((const uint*)partial.data())[bin];
+	}
+}
+//cumulative + normalise on the host, the same arithmetic as NormalizeHistogram_LUT
+template<typename CIMG_TYPE>
+std::vector<CIMG_TYPE> HostLut(std::vector<unsigned long long> histogram)
+{
+	const unsigned long long levels = 1ull << (sizeof(CIMG_TYPE) * 8);
+	std::vector<CIMG_TYPE> lut(histogram.size());
+	for (size_t bin = 1; bin < histogram.size(); bin++) histogram[bin] += histogram[bin - 1];
+	unsigned long long max_val = std::max<unsigned long long>(histogram.back(), 1);
+	for (size_t bin = 0; bin < histogram.size(); bin++) {
+		lut[bin] = (CIMG_TYPE)std::min(histogram[bin] * levels / max_val, levels - 1);
+	}
+	return lut;
+}
+//builds every source with the given options, printing the build log on failure
+//a cached binary for the same device, sources and options is used instead when there is one (see ProgramCache.h)
+inline cl::Program BuildProgram(cl::Context& context, cl::Program::Sources& sources, const std::string& options)
+{
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	std::filesystem::path cacheEntry = ProgramCache::EntryPath(device, sources, options);
+	cl::Program program;
+	if (ProgramCache::Load(context, device, cacheEntry, options, program)) return program;
+	program = cl::Program(context, sources);
+	try {
+		program.build(options.c_str());
+	}
+	catch (const cl::Error& err) {
+		std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+		std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+		std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+		throw err;
+	}
+	ProgramCache::Store(program, cacheEntry);
+	return program;
+}
+
 template <typename CIMG_TYPE>
 class ImageProcessor
 {
 public:
 	//Constructors, Destructors
-	ImageProcessor(int platform_id, int device_id, int workgroup_size,int _num_bins, std::string& image_filename, std::string& kernel_folder, bool useProfiling, bool _ignoreColour,bool _displayHistograms)
-		:group_size(workgroup_size),
+	ImageProcessor(int platform_id, int device_id, int workgroup_size,int _num_bins, int _vector_width, std::string& image_filename, std::string& kernel_folder, bool useProfiling, bool _ignoreColour,bool _displayHistograms, bool specialiseSize = false)
+		:inputPath(image_filename),
 		profilingEnabled(useProfiling),
-		num_bins(_num_bins),
+		displayHistograms(_displayHistograms),
 		ignoreColour(_ignoreColour),
+		group_size(workgroup_size),
+		num_bins(_num_bins),
+		//default to 16 byte loads (uchar16 / ushort8) which matches most SIMD widths
+		vector_width(_vector_width > 0 ? _vector_width : 16 / sizeof(CIMG_TYPE))
+	{
+		if (!MapImages()) {
+			inputImage = CImg::CImg<CIMG_TYPE>(image_filename.c_str());
+			outputImage = CImg::CImg<CIMG_TYPE>(inputImage.width(), inputImage.height(), inputImage.depth(), inputImage.spectrum());
+		}
+		Setup(platform_id, device_id, kernel_folder, specialiseSize);
+	}
+	//takes an image that is already in memory (e.g. synthetic benchmark inputs)
+	ImageProcessor(int platform_id, int device_id, int workgroup_size, int _num_bins, int _vector_width, CImg::CImg<CIMG_TYPE> image, std::string& kernel_folder, bool useProfiling, bool _ignoreColour, bool _displayHistograms, bool specialiseSize = false)
+		:inputPath("image.pgm"),
+		profilingEnabled(useProfiling),
 		displayHistograms(_displayHistograms),
-		inputPath(image_filename)
+		ignoreColour(_ignoreColour),
+		group_size(workgroup_size),
+		num_bins(_num_bins),
+		vector_width(_vector_width > 0 ? _vector_width : 16 / sizeof(CIMG_TYPE))
 	{
-		//load images
-		inputImage = CImg::CImg<CIMG_TYPE>(image_filename.c_str());
+		image.move_to(inputImage);
 		outputImage = CImg::CImg<CIMG_TYPE>(inputImage.width(), inputImage.height(), inputImage.depth(), inputImage.spectrum());
+		Setup(platform_id, device_id, kernel_folder, specialiseSize);
+	}
+	virtual ~ImageProcessor() {}
+protected:
+	//P5/P6 files whose sample size matches CIMG_TYPE are mapped instead of loaded (see MappedPnm.h), with the output mapped
+	//to its final file -- colour stays interleaved as in the file, so there is no deinterleave on load or reinterleave on save
+	bool MapImages() {
+		mappedInput = std::make_unique<MappedPnm>();
+		if (!mappedInput->Open(inputPath) || mappedInput->BytesPerSample() != sizeof(CIMG_TYPE)) {
+			mappedInput.reset();
+			return false;
+		}
+		mappedOutput = std::make_unique<MappedPnm>();
+		if (!mappedOutput->Create(OutputPath(), mappedInput->Header().Equalised())) {
+			mappedInput.reset();
+			mappedOutput.reset();
+			return false;
+		}
+		//the image is width * channels samples wide, channels pooled (-c) do not care about the layout and
+		//kernels that keep them apart are told the stride (see AddKernel)
+		int width = mappedInput->Width() * mappedInput->Channels();
+		interleavedChannels = ignoreColour ? 1 : mappedInput->Channels();
+		if ((uintptr_t)mappedInput->Pixels() % alignof(CIMG_TYPE) == 0) {
+			inputImage.assign((CIMG_TYPE*)mappedInput->Pixels(), width, mappedInput->Height(), 1, 1, true);
+		}
+		else {
+			//an odd length header leaves 16 bit samples misaligned, so they are copied out -- still one plain copy rather than a CImg load
+			inputImage.assign(width, mappedInput->Height(), 1, 1);
+			std::memcpy(inputImage.data(), mappedInput->Pixels(), mappedInput->PixelBytes());
+		}
+		//the output's header is padded so its samples always are aligned
+		outputImage.assign((CIMG_TYPE*)mappedOutput->Pixels(), width, mappedInput->Height(), 1, 1, true);
+		byteSwap = sizeof(CIMG_TYPE) > 1;
+		std::cout << "Mapped " << inputPath << " and " << OutputPath() << (byteSwap ? ", swapping 16 bit samples on the device" : "") << std::endl;
+		return true;
+	}
+	std::string OutputPath() const { return "equalized_" + inputPath; }
+	void Setup(int platform_id, int device_id, std::string& kernel_folder, bool specialiseSize)
+	{
 		//setup openCL program
 		context = Utils::GetContext(platform_id, device_id);
 		Utils::AddAllSources(sources, kernel_folder);
-		queue = cl::CommandQueue(context, useProfiling ? CL_QUEUE_PROFILING_ENABLE : 0U);
-		program = cl::Program(context, sources);
+		queue = cl::CommandQueue(context, profilingEnabled ? CL_QUEUE_PROFILING_ENABLE : 0U);
+		pool = DevicePool(context);
 
-		//TODO we know the input size before we compile -- we can pass the input size in as a #define to the compiler along with other needed info like num buckets 
 		//build openCL program
-		try {
-			std::stringstream compileOptions;
-			compileOptions << "-D NUM_BINS=" << num_bins << " ";
-			compileOptions << "-D BIT_DEPTH=" <<  sizeof(CIMG_TYPE)* 8 << " ";
-			compileOptions << "-D DATA_TYPE=" << GetCLTypename<CIMG_TYPE>() << " ";
-			compileOptions << "-D HIST_TYPE=" << STR(HIST_TYPE) << " ";
-			compileOptions << "-D IMAGE_SIZE=" << inputImage.size() << " ";
-			program.build(compileOptions.str().c_str());
-		}
-		catch (const cl::Error& err) {
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
-		}
+		//specialiseSize fixes the pixel count per channel at build time (-F), otherwise the program is size independent
+		size_t channelSize = ignoreColour ? inputImage.size() : inputImage.size() / (inputImage.spectrum() * interleavedChannels);
+		program = BuildProgram(context, sources, GetBuildOptions<CIMG_TYPE>(num_bins, vector_width, inputImage.size(), specialiseSize ? channelSize : 0));
 
 		//setup openCL I/O
-		ImageBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, inputImage.size() * sizeof(CIMG_TYPE));
-		//allocated device buffers for histograms
-		histogramA = cl::Buffer(context, CL_MEM_READ_WRITE, num_bins * sizeof(HIST_TYPE));
-		histogramB = cl::Buffer(context, CL_MEM_READ_WRITE, num_bins * sizeof(HIST_TYPE));
+		if (inputImage.size() * sizeof(CIMG_TYPE) > context.getInfo<CL_CONTEXT_DEVICES>()[0].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>()) {
+			std::cout << "Image is larger than the device's largest buffer, use tiled mode (-T) instead" << std::endl;
+		}
+		//devices that share host memory (CPU devices such as PoCL, integrated GPUs) get a zero-copy image buffer living in outputImage's memory
+		//the kernels see the flag on the buffer and upload / read back by mapping it instead of copying
+		//CImg's allocation is not page aligned, and many drivers quietly fall back to a copy for CL_MEM_USE_HOST_PTR memory that is not,
+		//so this is only zero-copy on drivers that accept any alignment
+		if (context.getInfo<CL_CONTEXT_DEVICES>()[0].getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>()) {
+			std::cout << "Device shares host memory, using a zero-copy image buffer" << std::endl;
+			if ((uintptr_t)outputImage.data() % pageSize != 0) std::cout << "The output image is not page aligned, the driver may still copy it" << std::endl;
+			//not from the pool, it is tied to outputImage
+			ImageBuffer = std::make_shared<cl::Buffer>(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, outputImage.size() * sizeof(CIMG_TYPE), outputImage.data());
+		}
+		else {
+			ImageBuffer = pool.Acquire(inputImage.size() * sizeof(CIMG_TYPE));
+		}
+		//histograms and scratch buffers are leased from the pool by each kernel in Init
 	}
-	virtual ~ImageProcessor() {}
 public:
 	//Publicly accessible functions
 	void AddKernel(ImageProcessorKernel<CIMG_TYPE>* kernel) {
-		kernel->Init(program, inputImage, outputImage, queue, ImageBuffer, histogramA, histogramB, num_bins,group_size,ignoreColour,displayHistograms);
+		if (interleavedChannels > 1 && !kernel->HandlesInterleaved()) {
+			std::cout << "Skipping kernel: " << kernel->GetName() << " (needs planar channels, use -c to pool the mapped colour image)" << std::endl;
+			return;
+		}
+		kernel->SetByteSwap(byteSwap);
+		kernel->SetInterleaved(interleavedChannels);
+		kernel->Init(program, inputImage, outputImage, queue, ImageBuffer, pool, num_bins,group_size,vector_width,ignoreColour,displayHistograms);
 		allKernels.push_back(kernel);
 	}
+	//direct access for benchmarks that drive kernels themselves
+	cl::Context& GetContext() { return context; }
+	cl::CommandQueue& GetQueue() { return queue; }
+	cl::Program& GetProgram() { return program; }
+	//bytes per global histogram bin the kernels will use for this image (see HistTypeSize)
+	size_t HistSize() const { return HistTypeSize(inputImage.size()); }
+	bool FitsInLocalMemory(size_t bytes) {
+		return context.getInfo<CL_CONTEXT_DEVICES>()[0].getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() >= bytes;
+	}
 	void RunAll() {
 		if (allKernels.size() == 0) {
 			std::cerr << "No kernels added to image processor!" << std::endl;
 			return;
 		}
 		std::chrono::time_point start = std::chrono::high_resolution_clock::now();
+		//every kernel's pipeline is enqueued behind the previous one's read back (they share the device buffers)
+		//nothing blocks until the last read back, which is the only point the host waits for the device (zero-copy uploads
+		//excepted, they wait on their map -- see EnqueueUpload)
+		cl::Event last;
 		for (ImageProcessorKernel<CIMG_TYPE>* kernel : allKernels) {
-			std::cout << "\nNow Running kernel: " << kernel->GetName() << "!" << std::endl;
-			kernel->Run(profilingEnabled);
+			std::cout << "Queueing kernel: " << kernel->GetName() << std::endl;
+			last = kernel->Run(last);
 		}
+		last.wait();
 		std::chrono::time_point end = std::chrono::high_resolution_clock::now();
 		if (!profilingEnabled) return;
+		//profiling is read from the events each kernel kept, now that they have all completed
+		for (ImageProcessorKernel<CIMG_TYPE>* kernel : allKernels) {
+			std::cout << "\nKernel: " << kernel->GetName() << std::endl;
+			kernel->ReportProfiling();
+		}
 		std::cout << "\nTotal execution time for all kernels [ns]: " << std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() << std::endl;
+		pool.Report();
 
 	}
 	void DisplayImages() {
-		CImg::CImgDisplay disp_input(inputImage, "Input");
-		CImg::CImgDisplay disp_output(outputImage, "Output");
+		CImg::CImgDisplay disp_input(Displayable(inputImage), "Input");
+		CImg::CImgDisplay disp_output(Displayable(outputImage), "Output");
 		while (!disp_input.is_closed() && !disp_output.is_closed()
 			&& !disp_input.is_keyESC() && !disp_output.is_keyESC())
 		{
 			disp_input.wait(1);
 			disp_output.wait(1);
 		}
-		outputImage.save(("equalized_" + inputPath).c_str());
+		//a mapped output already is the file
+		if (!mappedOutput) outputImage.save(OutputPath().c_str());
 	}
 protected:
+	//mapped images are laid out as in the file, the displays get planar, native order copies
+	CImg::CImg<CIMG_TYPE> Displayable(const CImg::CImg<CIMG_TYPE>& image) {
+		CImg::CImg<CIMG_TYPE> copy(image, false);
+		if (byteSwap) copy.invert_endianness();
+		if (interleavedChannels > 1) {
+			//samples as (channel, x, y) then moved to CImg's (x, y, channel)
+			copy.resize(interleavedChannels, image.width() / interleavedChannels, image.height(), 1, -1).permute_axes("yzcx");
+		}
+		return copy;
+	}
 	std::string inputPath;
 	bool profilingEnabled;
 	bool displayHistograms;
 	bool ignoreColour;
 	int group_size;
 	int num_bins;
+	int vector_width;
 	cl::Program::Sources sources;
 	cl::Context context;
 	cl::CommandQueue queue;
 	cl::Program program;
 	
-	cl::Buffer ImageBuffer;
-
-	cl::Buffer histogramA;
-	cl::Buffer histogramB;
+	DevicePool pool;
+	DeviceLease ImageBuffer;
+	static const size_t pageSize = 4096; //the usual host page, what drivers want CL_MEM_USE_HOST_PTR memory aligned to
 
 	std::vector<ImageProcessorKernel<CIMG_TYPE>*> allKernels;
 
+	//declared before the images so they are unmapped after the shared images over them are gone
+	std::unique_ptr<MappedPnm> mappedInput;
+	std::unique_ptr<MappedPnm> mappedOutput;
+	bool byteSwap = false; //mapped 16 bit samples are big-endian
+	int interleavedChannels = 1; //mapped colour samples are packed RGB
 	CImg::CImg<CIMG_TYPE> inputImage;
 	CImg::CImg<CIMG_TYPE> outputImage;
 
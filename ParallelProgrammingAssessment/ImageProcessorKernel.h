@@ -2,7 +2,11 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <climits>
+#include <cstring>
+#include <map>
 #include "Utils.h"
+#include "DevicePool.h"
 #include "Vendor/CImg.h"
 //this class only exists so that I can run many different versions of the algorithm from a single version of the ImageProcessor class
 //its slightly over-engineered but it's not that deep that I need to find a "perfect" way to make it all go
@@ -13,8 +17,11 @@ typedef unsigned int uint;
 typedef unsigned long long ulong; //i developed this in VS22 and in windows a single long is still 32 bits ty microsoft
 //#define CIMG_TYPE uchar
 //#define CIMG_TYPE ushort
-//#define HIST_TYPE uint
-#define HIST_TYPE ulong
+//local (per workgroup) histograms can never count past 2^32 so they always use 32 bit counters - this also avoids 64 bit local atomics
+#define LOCAL_HIST_TYPE uint
+//the global HIST_TYPE is picked per image - 64 bit counters are only needed once a histogram could hold more than 2^32 pixels
+inline size_t HistTypeSize(size_t pixelCount) { return pixelCount > UINT_MAX ? sizeof(ulong) : sizeof(uint); }
+inline const char* HistTypeName(size_t pixelCount) { return pixelCount > UINT_MAX ? "ulong" : "uint"; }
 //https://stackoverflow.com/questions/47346133/how-to-use-a-define-inside-a-format-string
 //for passing above into CL compiler
 #define STR_(X) #X
@@ -24,56 +31,268 @@ namespace CImg = cimg_library;
 
 //because of the templating I have to stack the class and the impl into the same header
 
+//which scan the accumulate step of the global/local pipelines uses
+enum class ScanMethod {
+	Default, //each pipeline's own scan (Hillis-Steele)
+	Blelloch //work-efficient up-sweep/down-sweep staged through local memory (AccumulateHistogram_Blelloch)
+};
+//the Blelloch up-sweep/down-sweep only works on a power of 2 group, -w can be anything so the scan runs with the largest
+//power of 2 that fits in it instead (the kernel walks the bins in chunks, so a smaller group only means more chunks)
+inline int ScanGroupSize(int workgroup_size) {
+	int size = 1;
+	while (size * 2 <= workgroup_size) size *= 2;
+	return size;
+}
+
+
+//the decoupled look-back scan (AccumulateHistogram_LookBack) spins on other groups, so it only terminates if the device keeps every started group running
+//OpenCL does not promise that, so it is checked once per device with ForwardProgressProbe and the answer cached
+inline bool SupportsLookBackScan(cl::Program& program, cl::CommandQueue& queue, int workgroup_size) {
+	static std::map<cl_device_id, bool> checked;
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	auto found = checked.find(device());
+	if (found != checked.end()) return found->second;
+	//status words pack a value and a flag into 64 bits
+	bool supported = device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_int64_base_atomics") != std::string::npos;
+	if (supported) {
+		size_t groups = (size_t)device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 64; //far more groups than can be resident at once
+		cl::Context context = queue.getInfo<CL_QUEUE_CONTEXT>();
+		cl::Buffer flags(context, CL_MEM_READ_WRITE, (groups + 1) * sizeof(cl_ulong));
+		cl::Buffer failed(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+		queue.enqueueFillBuffer<cl_ulong>(flags, 0, 0, (groups + 1) * sizeof(cl_ulong));
+		queue.enqueueFillBuffer<cl_uint>(failed, 0, 0, sizeof(cl_uint));
+		cl::Kernel probe(program, "ForwardProgressProbe");
+		probe.setArg(0, flags);
+		probe.setArg(1, failed);
+		probe.setArg(2, (cl_uint)(1 << 24));
+		queue.enqueueNDRangeKernel(probe, cl::NullRange, cl::NDRange(groups * workgroup_size), cl::NDRange(workgroup_size));
+		cl_uint result = 1;
+		queue.enqueueReadBuffer(failed, CL_TRUE, 0, sizeof(cl_uint), &result);
+		supported = result == 0;
+	}
+	checked[device()] = supported;
+	return supported;
+}
 
 template<typename CIMG_TYPE>
 class ImageProcessorKernel {
 public:
 	//Constructors, Destructors
-	ImageProcessorKernel(const char* _kernelName) : kernelName(_kernelName) {}
-	~ImageProcessorKernel() {}
+	ImageProcessorKernel(const char* _kernelName) : kernelName(_kernelName), baseName(_kernelName) {}
+	virtual ~ImageProcessorKernel() {} //virtual so batch slots can own a kernel through a base pointer
 public:
+	//must be called before Init()
+	void SetScanMethod(ScanMethod method) { scanMethod = method; }
+	//must be called before Init() -- the input is big-endian 16 bit, swapped after the upload and back before the read back
+	void SetByteSwap(bool swap) { byteSwap = swap; }
+	//must be called before Init() -- the image holds this many channels interleaved (packed RGB) rather than one after another
+	void SetInterleaved(int channels) { interleavedChannels = channels; }
+	//only kernels that index channels by stride can take an interleaved image, the rest offset to each channel's start
+	virtual bool HandlesInterleaved() const { return false; }
 	//must be called before Run() TODO add check inside run
+	//the image buffer is shared with whoever fills it, everything else the kernel needs (histograms, scratch) is leased from the pool
 	virtual void Init(cl::Program& program, CImg::CImg<CIMG_TYPE>& _InputImage, CImg::CImg<CIMG_TYPE>& _OutputImage, 
-		cl::CommandQueue& _Queue, cl::Buffer& _DeviceImage, cl::Buffer& _HistogramA, cl::Buffer& _HistogramB, int _num_bins, int _workgroup_size, bool _ignoreColour, bool _displayHistograms)
+		cl::CommandQueue& _Queue, DeviceLease _DeviceImage, DevicePool& _Pool, int _num_bins, int _workgroup_size, int _vector_width, bool _ignoreColour, bool _displayHistograms)
 	{
-		Image = &_DeviceImage;
-		HistogramA = &_HistogramA;
-		HistogramB = &_HistogramB;
+		kernelName = baseName; //Init can be called again for a new image (batch mode), drop the previous strategy suffixes
+		//and hand the previous image's buffers back first, so this image can be given the same ones
+		ReleaseBuffers();
+		Pool = &_Pool;
+		leases.push_back(_DeviceImage);
+		Image = _DeviceImage.get();
 		InputImage = &_InputImage;
 		OutputImage = &_OutputImage;
 		Queue = &_Queue;
 		num_bins = _num_bins;
+		hist_size = HistTypeSize(_InputImage.size());
 		workgroup_size = _workgroup_size;
+		vector_width = _vector_width;
 		ignoreColour = _ignoreColour;
 		displayHistograms = _displayHistograms;
+		zeroCopy = (_DeviceImage->getInfo<CL_MEM_FLAGS>() & CL_MEM_USE_HOST_PTR) != 0;
+		histogramA = Acquire(num_bins * hist_size);
+		histogramB = Acquire(num_bins * hist_size);
+		HistogramA = &histogramA;
+		HistogramB = &histogramB;
+		if (scanMethod == ScanMethod::Blelloch) {
+			blellochKernel = cl::Kernel(program, "AccumulateHistogram_Blelloch");
+			blellochKernel.setArg(0, *HistogramA);
+			blellochKernel.setArg(1, cl::Local(hist_size * ScanGroupSize(workgroup_size) * 2));
+			blellochKernel.setArg(2, (cl_uint)num_bins);
+		}
+		if (byteSwap) {
+			byteSwapKernel = cl::Kernel(program, "ByteSwap16");
+			byteSwapKernel.setArg(0, *Image);
+			byteSwapKernel.setArg(1, (cl_ulong)_InputImage.size());
+		}
 	}
 public:
 	//Publicly accessible functions
-	virtual void Run(bool print) = 0;
+	//enqueues the whole pipeline without blocking -- the first command waits on after (e.g. the previous kernel's read back)
+	//returns the event of the final read back, OutputImage is not valid until it has completed
+	virtual cl::Event Run(const cl::Event& after) = 0;
+	//collects timings from the events kept by the last Run(), only once its final event has completed (needs profiling enabled)
+	virtual void ReportProfiling() {
+		kernelTime = 0;
+		histogramTime = 0;
+		for (const cl::Event& event : kernelEvents) kernelTime += EventTime(event);
+		for (const cl::Event& event : histogramEvents) histogramTime += EventTime(event);
+		std::cout
+			<< "Copy host-to-device time [ns]: "
+			<< EventTime(inputCopyEvent) << "\n"
+			<< "Kernel execution time [ns]: "
+			<< kernelTime << "\n"
+			<< "Copy device-to-host time [ns]: "
+			<< EventTime(outputCopyEvent)
+			<< std::endl;
+	}
 	const std::string_view GetName() const { return kernelName; }
+	//timings of the last profiled Run()
+	cl_ulong GetKernelTime() const { return kernelTime; }
+	cl_ulong GetHistogramTime() const { return histogramTime; }
+	//gives every leased buffer back to the pool -- only once the last Run() has completed
+	void ReleaseBuffers() { leases.clear(); }
 protected:
 	//references to external stuff that get re-used across different kernel runs
 	int num_bins;
+	size_t hist_size; //bytes per global histogram bin (see HistTypeSize)
 	int workgroup_size;
+	int vector_width;
 	bool ignoreColour;
 	bool displayHistograms;
+	bool zeroCopy = false; //Image is allocated over OutputImage's memory (see ImageProcessor)
 	cl::Buffer* Image;
 	cl::Buffer* HistogramA;
 	cl::Buffer* HistogramB;
+	cl::Buffer histogramA;
+	cl::Buffer histogramB;
+	DevicePool* Pool;
+	std::vector<DeviceLease> leases; //held until the next Init or ReleaseBuffers()
 	cl::CommandQueue* Queue;
 	CImg::CImg<CIMG_TYPE>* InputImage;
 	CImg::CImg<CIMG_TYPE>* OutputImage;
 	std::string kernelName;
+	std::string baseName;
+	cl_ulong kernelTime = 0;
+	cl_ulong histogramTime = 0;
+	ScanMethod scanMethod = ScanMethod::Default;
+	cl::Kernel blellochKernel;
+	bool byteSwap = false;
+	cl::Kernel byteSwapKernel;
+	int interleavedChannels = 1;
+
+	//every command of a Run() waits on the one before it (chain), so the host never has to block between steps
+	//the events are kept so profiling can be read after the single sync at the end instead of mid-pipeline
+	std::vector<cl::Event> chain;
+	std::vector<cl::Event> kernelEvents;
+	std::vector<cl::Event> histogramEvents; //subset of kernelEvents that make up the histogram step
+	cl::Event inputCopyEvent;
+	cl::Event outputCopyEvent;
+
+	static cl_ulong EventTime(const cl::Event& event) {
+		return event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+	}
+	//first command of every Run() -- also drops the events of the previous one
+	void EnqueueUpload(const cl::Event& after) {
+		chain.clear();
+		kernelEvents.clear();
+		histogramEvents.clear();
+		if (after() != nullptr) chain.push_back(after);
+		size_t bytes = InputImage->size() * sizeof(CIMG_TYPE);
+		if (!zeroCopy) {
+			Queue->enqueueWriteBuffer(*Image, CL_FALSE, 0, bytes, &InputImage->data()[0], &chain, &inputCopyEvent);
+		}
+		else {
+			//the buffer is OutputImage's memory, so mapping it hands back that memory and the input is copied straight in on the host
+			//(the pipeline works in place, so this one copy is needed anyway) -- the map blocks, as the host writes through it
+			void* mapped = Queue->enqueueMapBuffer(*Image, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, bytes, &chain);
+			std::memcpy(mapped, &InputImage->data()[0], bytes);
+			Queue->enqueueUnmapMemObject(*Image, mapped, nullptr, &inputCopyEvent);
+		}
+		chain = { inputCopyEvent };
+		if (byteSwap) EnqueueByteSwap();
+	}
+	//counted as part of the copies rather than the kernels, so it is left out of kernelEvents
+	void EnqueueByteSwap() {
+		size_t count = InputImage->size();
+		size_t globalSize = ((count + workgroup_size - 1) / workgroup_size) * workgroup_size;
+		cl::Event event;
+		Queue->enqueueNDRangeKernel(byteSwapKernel, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(workgroup_size), &chain, &event);
+		chain = { event };
+	}
+	//leases a buffer of at least bytes for as long as this Init lasts
+	cl::Buffer Acquire(size_t bytes) {
+		leases.push_back(Pool->Acquire(bytes));
+		return *leases.back();
+	}
+	void EnqueueFill(cl::Buffer& buffer, size_t bytes) {
+		cl::Event event;
+		Queue->enqueueFillBuffer<uint>(buffer, 0, 0, bytes, &chain, &event);
+		chain = { event };
+	}
+	void EnqueueKernel(cl::Kernel& kernel, const cl::NDRange& offset, const cl::NDRange& global, const cl::NDRange& local, bool histogramStep = false) {
+		cl::Event event;
+		Queue->enqueueNDRangeKernel(kernel, offset, global, local, &chain, &event);
+		kernelEvents.push_back(event);
+		if (histogramStep) histogramEvents.push_back(event);
+		chain = { event };
+	}
+	//last command of every Run()
+	cl::Event EnqueueDownload() {
+		size_t bytes = OutputImage->size() * sizeof(CIMG_TYPE);
+		if (byteSwap) EnqueueByteSwap();
+		if (!zeroCopy) {
+			Queue->enqueueReadBuffer(*Image, CL_FALSE, 0, bytes, &OutputImage->data()[0], &chain, &outputCopyEvent);
+			return outputCopyEvent;
+		}
+		//the buffer already is OutputImage, mapping just makes the results visible to the host - unmapped straight away so the next Run() can use it
+		void* mapped = Queue->enqueueMapBuffer(*Image, CL_FALSE, CL_MAP_READ, 0, bytes, &chain, &outputCopyEvent);
+		std::vector<cl::Event> waitMap = { outputCopyEvent };
+		cl::Event unmapEvent;
+		Queue->enqueueUnmapMemObject(*Image, mapped, &waitMap, &unmapEvent);
+		return unmapEvent;
+	}
+
+	//work-efficient scan of HistogramA in place -- a single group walks the histogram 2 * ScanGroupSize bins at a time
+	void EnqueueBlellochScan() {
+		int scanGroup = ScanGroupSize(workgroup_size);
+		EnqueueKernel(blellochKernel, cl::NullRange, cl::NDRange(scanGroup), cl::NDRange(scanGroup));
+	}
+
+	//launches one work-item per pixel of a channel, rounded up to whole groups -- the kernel bounds checks against count
+	//offset and count are passed as arguments (from firstArg) so the built program does not depend on the image size
+	void EnqueuePerPixel(cl::Kernel& kernel, cl_uint firstArg, size_t offset, size_t count, bool histogramStep = false) {
+		size_t globalSize = ((count + workgroup_size - 1) / workgroup_size) * workgroup_size;
+		kernel.setArg(firstArg, (cl_ulong)offset);
+		kernel.setArg(firstArg + 1, (cl_ulong)count);
+		EnqueueKernel(kernel, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(workgroup_size), histogramStep);
+	}
+
+	//launches one work-item per vector_width pixels of a channel -- the kernel handles the ragged tail itself
+	//offset and count are passed as the last two arguments since the global range no longer maps 1:1 onto pixels
+	void EnqueueVectorised(cl::Kernel& kernel, cl_uint firstArg, size_t offset, size_t count, bool histogramStep = false) {
+		size_t chunks = (count + vector_width - 1) / vector_width;
+		size_t globalSize = ((chunks + workgroup_size - 1) / workgroup_size) * workgroup_size;
+		kernel.setArg(firstArg, (cl_ulong)offset);
+		kernel.setArg(firstArg + 1, (cl_ulong)count);
+		EnqueueKernel(kernel, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(workgroup_size), histogramStep);
+	}
 
 	//helper function to display intermediate histogram
-	void ShowHistogram(const char* title) {
+	//shows HistogramA unless the step wrote its graph somewhere else
+	void ShowHistogram(const char* title, cl::Buffer* Source = nullptr) {
 		if (!displayHistograms) return;
-		CImg::CImg<HIST_TYPE> histDisplay(num_bins, 1, 1, 1);
-		HIST_TYPE* Buf = &histDisplay.data()[0];
-		Queue->enqueueReadBuffer(*HistogramA, CL_TRUE, 0, num_bins * sizeof(HIST_TYPE), Buf);
+		CImg::CImg<ulong> histDisplay(num_bins, 1, 1, 1);
+		ulong* Buf = &histDisplay.data()[0];
+		Queue->enqueueReadBuffer(Source ? *Source : *HistogramA, CL_TRUE, 0, num_bins * hist_size, Buf, &chain); //debug only, so blocking here is fine
+		if (hist_size == sizeof(uint)) {
+			//widen 32 bit bins in place - back to front so no bin is overwritten before it is read
+			uint* Narrow = (uint*)Buf;
+			for (int i = num_bins - 1; i >= 0; i--) Buf[i] = Narrow[i];
+		}
 		std::filesystem::create_directory("graphs");
 		std::ofstream HStream(std::string("graphs/") + std::string(title) + ".csv");
-		HIST_TYPE maxVal = 0;
+		ulong maxVal = 0;
 		for (int i = 0; i < num_bins; i++) {
 			HStream << Buf[i] << ",";
 			if (Buf[i] > maxVal) {
@@ -107,24 +326,22 @@ public:
 	GlobalKernel() : ImageProcessorKernel<CIMG_TYPE>("Basic (Global)") {}
 	virtual ~GlobalKernel() {}
 protected:
+	//lets variants that only change the per-pixel steps reuse the rest of the global pipeline
+	GlobalKernel(const char* _kernelName) : ImageProcessorKernel<CIMG_TYPE>(_kernelName) {}
 	//kernels of each algorithm step
 	cl::Kernel histogramKernel;
 	cl::Kernel accumulateKernel;
 	cl::Kernel normalizeKernel;
 	cl::Kernel lookupKernel;
-	//events to profile execution time
-	cl::Event histogramEvent;
-	cl::Event accumulateEvent;
-	cl::Event normalizeEvent;
-	cl::Event lookupEvent;
-	cl::Event inputCopyEvent;
-	cl::Event outputCopyEvent;
 public:
 	//must be called before Run()
 	virtual void Init(cl::Program& program, CImg::CImg<CIMG_TYPE>& InputImage, CImg::CImg<CIMG_TYPE>& OutputImage,
-		cl::CommandQueue& Queue, cl::Buffer& Image, cl::Buffer& HistogramA, cl::Buffer& HistogramB, int num_bins, int workgroup_size, bool ignoreColour, bool displayHistograms) override
+		cl::CommandQueue& Queue, DeviceLease DeviceImage, DevicePool& Pool, int num_bins, int workgroup_size, int vector_width, bool ignoreColour, bool displayHistograms) override
 	{
-		ImageProcessorKernel<CIMG_TYPE>::Init(program, InputImage, OutputImage, Queue, Image, HistogramA, HistogramA, num_bins,workgroup_size, ignoreColour, displayHistograms);
+		ImageProcessorKernel<CIMG_TYPE>::Init(program, InputImage, OutputImage, Queue, DeviceImage, Pool, num_bins, workgroup_size, vector_width, ignoreColour, displayHistograms);
+		cl::Buffer& Image = *this->Image;
+		cl::Buffer& HistogramA = *this->HistogramA;
+		cl::Buffer& HistogramB = *this->HistogramB;
 		histogramKernel = cl::Kernel(program, "createHistogram_Global");
 		histogramKernel.setArg(0, Image);
 		histogramKernel.setArg(1, HistogramA);
@@ -143,64 +360,49 @@ public:
 	}
 
 	//Publicly accessible functions
-	virtual void Run(bool print) override {
+	virtual cl::Event Run(const cl::Event& after) override {
 		//templating sucks -- idk if this issue is MSVC specific but apparently for everything i want to access from base class i have to add this
-		auto Queue = this->Queue;
-		auto Image = this->Image;
 		auto InputImage = this->InputImage;
 		auto HistogramA = this->HistogramA;
 		auto HistogramB = this->HistogramB;
-		auto OutputImage = this->OutputImage;
 		auto ignoreColour = this->ignoreColour;
 		auto num_bins = this->num_bins;
 		auto workgroup_size = this->workgroup_size;
 
-
-		cl_ulong kernelTotalTime = 0;
 		//allowing for 2 different handlings of colour images
 		int targetSpectrum = ignoreColour ? 1 : InputImage->spectrum();
 		size_t imageSize = InputImage->size() / targetSpectrum;
 		//adding to the global size to make sure the number of workgroups is valid
 		//the kernel code ensures extra threads are skipped to prevent out-of-range memory accesses
-		int imageExtraThreads = workgroup_size - (imageSize % workgroup_size);
 		int histExtraThreads = workgroup_size - (num_bins % workgroup_size);
 
-		Queue->enqueueWriteBuffer(*Image, CL_TRUE, 0, InputImage->size() * sizeof(CIMG_TYPE), &InputImage->data()[0], nullptr, &inputCopyEvent);
+		this->EnqueueUpload(after);
 		for (int col = 0; col < targetSpectrum; col++) {
 			//clear histograms
-			Queue->enqueueFillBuffer<HIST_TYPE>(*HistogramA, 0, 0, num_bins * sizeof(HIST_TYPE));
-			Queue->enqueueFillBuffer<HIST_TYPE>(*HistogramB, 0, 0, num_bins * sizeof(HIST_TYPE));
+			this->EnqueueFill(*HistogramA, num_bins * this->hist_size);
+			this->EnqueueFill(*HistogramB, num_bins * this->hist_size);
 			//run kernels --offset to run each colour separately
-			Queue->enqueueNDRangeKernel(histogramKernel, col * imageSize, cl::NDRange(imageSize + imageExtraThreads), cl::NDRange(workgroup_size), nullptr, &histogramEvent);
+			EnqueueHistogram(col * imageSize, imageSize);
 			this->ShowHistogram("GlobalBaseHistogram");
-			Queue->enqueueNDRangeKernel(accumulateKernel, cl::NullRange, num_bins + histExtraThreads, cl::NDRange(workgroup_size), nullptr, &accumulateEvent);
+			if (this->scanMethod == ScanMethod::Blelloch)
+				this->EnqueueBlellochScan();
+			else
+				this->EnqueueKernel(accumulateKernel, cl::NullRange, num_bins + histExtraThreads, cl::NDRange(workgroup_size));
 			this->ShowHistogram("GlobalCumulativeHistogram");
-			Queue->enqueueNDRangeKernel(normalizeKernel, cl::NullRange, num_bins + histExtraThreads, cl::NDRange(workgroup_size), nullptr, &normalizeEvent);
+			this->EnqueueKernel(normalizeKernel, cl::NullRange, num_bins + histExtraThreads, cl::NDRange(workgroup_size));
 			this->ShowHistogram("GlobalNormalHistogram");
-			Queue->enqueueNDRangeKernel(lookupKernel, col * imageSize, cl::NDRange(imageSize + imageExtraThreads), cl::NDRange(workgroup_size), nullptr, &lookupEvent);
-
-			if (!print) continue;
-			lookupEvent.wait();
-			for (const cl::Event& event : { histogramEvent,accumulateEvent,normalizeEvent,lookupEvent }) {
-				kernelTotalTime += event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-			}
+			EnqueueApply(col * imageSize, imageSize);
 		}
-
-
-		Queue->enqueueReadBuffer(*Image, CL_TRUE, 0, OutputImage->size() * sizeof(CIMG_TYPE), &OutputImage->data()[0], nullptr, &outputCopyEvent);
-		if (!print) return;
-		
-		
-		std::cout
-			<< "Copy host-to-device time [ns]: "
-			<< inputCopyEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - inputCopyEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n"
-			<< "Kernel execution time [ns]: "
-			<< kernelTotalTime << "\n"
-			<< "Copy device-to-host time [ns]: "
-			<< outputCopyEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - outputCopyEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>()
-			<< std::endl;
+		return this->EnqueueDownload();
+	}
+protected:
+	//one work-item per pixel -- overridden by variants that launch the per-pixel steps differently
+	virtual void EnqueueHistogram(size_t offset, size_t imageSize) {
+		this->EnqueuePerPixel(histogramKernel, 2, offset, imageSize, true);
+	}
+	virtual void EnqueueApply(size_t offset, size_t imageSize) {
+		this->EnqueuePerPixel(lookupKernel, 2, offset, imageSize);
 	}
-
 };
 
 //local DECLARATION
@@ -211,103 +413,670 @@ public:
 	LocalKernel() : ImageProcessorKernel<CIMG_TYPE>("Advanced (Local)") {}
 	virtual ~LocalKernel() {}
 protected:
+	//lets variants that only change the histogram step reuse the rest of the local pipeline
+	LocalKernel(const char* _kernelName) : ImageProcessorKernel<CIMG_TYPE>(_kernelName) {}
 	//kernels of each algorithm step
 	cl::Kernel histogramKernel;
 	cl::Kernel accumulate1Kernel;
 	cl::Kernel accumulate2Kernel;
+	cl::Kernel accumulate3Kernel;
 	cl::Kernel normalizeKernel;
 	cl::Kernel lookupKernel;
-	//events to profile execution time
-	cl::Event histogramEvent;
-	cl::Event accumulate1Event;
-	cl::Event accumulate2Event;
-	cl::Event normalizeEvent;
-	cl::Event lookupEvent;
-	cl::Event inputCopyEvent;
-	cl::Event outputCopyEvent;
+	//per-block totals for the scan of block sums
+	cl::Buffer BlockSums;
+	//single pass scan, used instead of the three phases when the histogram spans more than one group and the device allows it
+	bool useLookBack = false;
+	cl::Kernel lookBackKernel;
+	cl::Buffer LookBackStatus;
+	//equalisation mapping in the image's own type (see NormalizeHistogram_LUT) and where the apply step keeps it
+	cl::Buffer Lut;
+	bool lutInLocal = false;
+	static const int applyGroupsPerComputeUnit = 16;
+	size_t apply_groups = 1;
 public:
 	//must be called before Run()
 	virtual void Init(cl::Program& program, CImg::CImg<CIMG_TYPE>& InputImage, CImg::CImg<CIMG_TYPE>& OutputImage,
-		cl::CommandQueue& Queue, cl::Buffer& Image, cl::Buffer& HistogramA, cl::Buffer& HistogramB, int num_bins,int workgroup_size, bool ignoreColour, bool displayHistograms) override
+		cl::CommandQueue& Queue, DeviceLease DeviceImage, DevicePool& Pool, int num_bins, int workgroup_size, int vector_width, bool ignoreColour, bool displayHistograms) override
 	{
-		ImageProcessorKernel<CIMG_TYPE>::Init(program, InputImage, OutputImage, Queue, Image, HistogramA, HistogramA, num_bins,workgroup_size, ignoreColour, displayHistograms);
+		ImageProcessorKernel<CIMG_TYPE>::Init(program, InputImage, OutputImage, Queue, DeviceImage, Pool, num_bins, workgroup_size, vector_width, ignoreColour, displayHistograms);
+		cl::Buffer& Image = *this->Image;
 
 		histogramKernel = cl::Kernel(program, "createHistogram");
 		histogramKernel.setArg(0, Image);
-		histogramKernel.setArg(1, HistogramA);
-		histogramKernel.setArg(2, cl::Local(sizeof(HIST_TYPE) * num_bins));
+		histogramKernel.setArg(2, cl::Local(sizeof(LOCAL_HIST_TYPE) * num_bins));
 
 		accumulate1Kernel = cl::Kernel(program, "AccumulateHistogram_1");
-		accumulate1Kernel.setArg(0, HistogramA);
-		accumulate1Kernel.setArg(1, HistogramB);
-		accumulate1Kernel.setArg(2, cl::Local(sizeof(HIST_TYPE) * workgroup_size));
-		accumulate1Kernel.setArg(3, cl::Local(sizeof(HIST_TYPE) * workgroup_size));
+		accumulate1Kernel.setArg(2, cl::Local(this->hist_size * workgroup_size));
+		accumulate1Kernel.setArg(3, cl::Local(this->hist_size * workgroup_size));
+		BlockSums = this->Acquire(ScanBlocks() * this->hist_size);
 
-		accumulate2Kernel = cl::Kernel(program, "AccumulateHistogram_2");
-		accumulate2Kernel.setArg(0, HistogramB);
-		accumulate2Kernel.setArg(1, HistogramA);
+		//scan of block sums
+		accumulate2Kernel = cl::Kernel(program, "AccumulateHistogram_Blelloch");
+		accumulate2Kernel.setArg(1, cl::Local(this->hist_size * ScanGroupSize(workgroup_size) * 2));
+		accumulate2Kernel.setArg(2, (cl_uint)ScanBlocks());
 
-		normalizeKernel = cl::Kernel(program, "NormalizeHistogram");
-		normalizeKernel.setArg(0, HistogramA);
+		//uniform add
+		accumulate3Kernel = cl::Kernel(program, "AccumulateHistogram_3");
 
-		lookupKernel = cl::Kernel(program, "ApplyHistogram");
+		useLookBack = this->scanMethod == ScanMethod::Default && num_bins > workgroup_size && SupportsLookBackScan(program, Queue, workgroup_size);
+		if (useLookBack) {
+			lookBackKernel = cl::Kernel(program, "AccumulateHistogram_LookBack");
+			lookBackKernel.setArg(1, cl::Local(this->hist_size * workgroup_size));
+			lookBackKernel.setArg(2, cl::Local(this->hist_size * workgroup_size));
+			LookBackStatus = this->Acquire((ScanBlocks() + 1) * sizeof(cl_ulong)); //ticket + one status word per block
+			this->kernelName += " [look-back scan]";
+		}
+
+		size_t lutBytes = sizeof(CIMG_TYPE) * num_bins;
+		Lut = this->Acquire(lutBytes);
+		normalizeKernel = cl::Kernel(program, "NormalizeHistogram_LUT");
+
+		//local memory if the LUT fits, then constant memory, otherwise it stays in global (still 8x/4x smaller than the histogram)
+		cl::Device device = Queue.getInfo<CL_QUEUE_DEVICE>();
+		lutInLocal = lutBytes <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+		if (lutInLocal) {
+			lookupKernel = cl::Kernel(program, "ApplyLUT_Local");
+			lookupKernel.setArg(2, cl::Local(lutBytes));
+			apply_groups = (size_t)device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * applyGroupsPerComputeUnit;
+		}
+		else if (lutBytes <= device.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>()) {
+			lookupKernel = cl::Kernel(program, "ApplyLUT_Constant");
+		}
+		else {
+			lookupKernel = cl::Kernel(program, "ApplyLUT_Global");
+		}
 		lookupKernel.setArg(0, Image);
-		lookupKernel.setArg(1, HistogramA);
+		BindChannelBuffers(*this->HistogramA, *this->HistogramB, BlockSums, LookBackStatus, Lut);
 	}
 public:
 	//Publicly accessible functions
-	virtual void Run(bool print) override
+	virtual cl::Event Run(const cl::Event& after) override
 	{
 		//templating sucks -- idk if this issue is MSVC specific but apparently for everything i want to access from base class i have to add this
-		auto Queue = this->Queue;
-		auto ImageBuffer = this->Image;
 		auto InputImage = this->InputImage;
-		auto HistogramA = this->HistogramA;
-		auto HistogramB = this->HistogramB;
-		auto OutputImage = this->OutputImage;
 		auto ignoreColour = this->ignoreColour;
-		auto num_bins = this->num_bins;
-		auto workgroup_size = this->workgroup_size;
 
-		cl_ulong kernelTotalTime = 0;
 		//allowing for 2 different handlings of colour images
 		int targetSpectrum = ignoreColour ? 1 : InputImage->spectrum();
 		size_t imageSize = InputImage->size() / targetSpectrum;
+		this->EnqueueUpload(after);//initial copy
+		for (int col = 0; col < targetSpectrum; col++) {
+			//offset so that each colour runs separately
+			EnqueueChannel(col * imageSize, imageSize);
+		}
+		return this->EnqueueDownload();
+	}
+protected:
+	//blocks of the scan, matches the padded launches in EnqueueChannel()
+	size_t ScanBlocks() const { return this->num_bins / this->workgroup_size + 1; }
+	//points every kernel argument that is a per-channel buffer at the given set -- Init binds the kernel's own set,
+	//variants that run channels side by side rebind before enqueueing each channel (arguments are captured at enqueue)
+	void BindChannelBuffers(cl::Buffer& HistogramA, cl::Buffer& HistogramB, cl::Buffer& Sums, cl::Buffer& LookBack, cl::Buffer& Table) {
+		histogramKernel.setArg(1, HistogramA);
+		accumulate1Kernel.setArg(0, HistogramA);
+		accumulate1Kernel.setArg(1, HistogramB);
+		accumulate1Kernel.setArg(4, Sums);
+		accumulate2Kernel.setArg(0, Sums);
+		accumulate3Kernel.setArg(0, HistogramB);
+		accumulate3Kernel.setArg(1, Sums);
+		accumulate3Kernel.setArg(2, HistogramA);
+		if (useLookBack) {
+			lookBackKernel.setArg(0, HistogramA);
+			lookBackKernel.setArg(3, LookBack);
+		}
+		if (this->scanMethod == ScanMethod::Blelloch) this->blellochKernel.setArg(0, HistogramA);
+		normalizeKernel.setArg(0, HistogramA);
+		normalizeKernel.setArg(1, HistogramB); //free once the scan is done
+		normalizeKernel.setArg(2, Table);
+		lookupKernel.setArg(1, Table);
+	}
+	//the whole pipeline for one channel, on Queue behind chain
+	void EnqueueChannel(size_t offset, size_t imageSize) {
+		auto HistogramA = this->HistogramA;
+		auto HistogramB = this->HistogramB;
+		auto num_bins = this->num_bins;
+		auto workgroup_size = this->workgroup_size;
 		//adding to the global size to make sure the number of workgroups is valid
 		//the kernel code ensures extra threads are skipped to prevent out-of-range memory accesses
-		int imageExtraThreads = workgroup_size - (imageSize % workgroup_size);
 		int histExtraThreads = workgroup_size - (num_bins % workgroup_size);
-		Queue->enqueueWriteBuffer(*ImageBuffer, CL_TRUE, 0, InputImage->size() * sizeof(CIMG_TYPE), &InputImage->data()[0], nullptr, &inputCopyEvent);//initial copy
+		//clear hist
+		this->EnqueueFill(*HistogramA, num_bins * this->hist_size);
+		this->EnqueueFill(*HistogramB, num_bins * this->hist_size);
+
+		//run kernels
+		EnqueueHistogram(offset, imageSize);
+		this->ShowHistogram("LocalBaseHistogram");
+		if (this->scanMethod == ScanMethod::Blelloch) {
+			this->EnqueueBlellochScan(); //one group, one launch
+		}
+		else if (useLookBack) {
+			//single launch across every group
+			this->EnqueueFill(LookBackStatus, (num_bins / workgroup_size + 2) * sizeof(cl_ulong));
+			this->EnqueueKernel(lookBackKernel, cl::NullRange, num_bins + histExtraThreads, cl::NDRange(workgroup_size));
+		}
+		else {
+			//three phase scan -- block scans, scan of the block sums, uniform add
+			this->EnqueueKernel(accumulate1Kernel, cl::NullRange, num_bins + histExtraThreads, cl::NDRange(workgroup_size));
+			this->EnqueueKernel(accumulate2Kernel, cl::NullRange, cl::NDRange(ScanGroupSize(workgroup_size)), cl::NDRange(ScanGroupSize(workgroup_size)));
+			this->EnqueueKernel(accumulate3Kernel, cl::NullRange, num_bins + histExtraThreads, cl::NDRange(workgroup_size));
+		}
+		this->ShowHistogram("LocalCumulativeHistogram");
+		this->EnqueueKernel(normalizeKernel, cl::NullRange, num_bins + histExtraThreads, cl::NDRange(workgroup_size));
+		this->ShowHistogram("LocalNormalHistogram", HistogramB);
+		EnqueueApply(offset, imageSize);
+	}
+	//one work-item per pixel -- overridden by variants that launch the histogram step differently
+	virtual void EnqueueHistogram(size_t offset, size_t imageSize) {
+		this->EnqueuePerPixel(histogramKernel, 3, offset, imageSize, true);
+	}
+	virtual void EnqueueApply(size_t offset, size_t imageSize) {
+		int workgroup_size = this->workgroup_size;
+		if (lutInLocal) {
+			//grid-stride so each group only copies the LUT in once
+			size_t groups = std::min(apply_groups, (imageSize + workgroup_size - 1) / workgroup_size);
+			lookupKernel.setArg(3, (cl_ulong)imageSize);
+			this->EnqueueKernel(lookupKernel, offset, cl::NDRange(groups * workgroup_size), cl::NDRange(workgroup_size));
+			return;
+		}
+		this->EnqueuePerPixel(lookupKernel, 2, offset, imageSize);
+	}
+};
+
+//grid-stride version of the local kernel
+//a fixed number of persistent groups (tied to the number of compute units) loops over the whole channel
+//so each group clears and flushes its local histogram once instead of once every workgroup_size pixels
+template<typename CIMG_TYPE>
+class GridStrideKernel : public LocalKernel<CIMG_TYPE>
+{
+public:
+	GridStrideKernel() : LocalKernel<CIMG_TYPE>("Grid-stride (Local)") {}
+	virtual ~GridStrideKernel() {}
+protected:
+	GridStrideKernel(const char* _kernelName) : LocalKernel<CIMG_TYPE>(_kernelName) {}
+	//enough groups per compute unit to hide memory latency, but few enough that the flush stays cheap
+	static const int groupsPerComputeUnit = 4;
+	size_t num_groups = 1;
+public:
+	//must be called before Run()
+	virtual void Init(cl::Program& program, CImg::CImg<CIMG_TYPE>& InputImage, CImg::CImg<CIMG_TYPE>& OutputImage,
+		cl::CommandQueue& Queue, DeviceLease DeviceImage, DevicePool& Pool, int num_bins, int workgroup_size, int vector_width, bool ignoreColour, bool displayHistograms) override
+	{
+		LocalKernel<CIMG_TYPE>::Init(program, InputImage, OutputImage, Queue, DeviceImage, Pool, num_bins, workgroup_size, vector_width, ignoreColour, displayHistograms);
+		cl::Buffer& Image = *this->Image;
+		cl::Buffer& HistogramA = *this->HistogramA;
+
+		this->histogramKernel = cl::Kernel(program, "createHistogram_GridStride");
+		this->histogramKernel.setArg(0, Image);
+		this->histogramKernel.setArg(1, HistogramA);
+		this->histogramKernel.setArg(2, cl::Local(sizeof(LOCAL_HIST_TYPE) * num_bins));
+
+		cl::Device device = Queue.getInfo<CL_QUEUE_DEVICE>();
+		num_groups = (size_t)device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * groupsPerComputeUnit;
+	}
+protected:
+	virtual void EnqueueHistogram(size_t offset, size_t imageSize) override {
+		size_t workgroup_size = this->workgroup_size;
+		//no point launching groups that would have no pixels to visit
+		size_t groups = std::min(num_groups, (imageSize + workgroup_size - 1) / workgroup_size);
+		//the global size no longer covers the image so the kernel needs the pixel count to know where the channel ends
+		this->histogramKernel.setArg(3, (cl_ulong)imageSize);
+		this->EnqueueKernel(this->histogramKernel, offset, cl::NDRange(groups * workgroup_size), cl::NDRange(workgroup_size), true);
+	}
+};
+
+//vectorised version of the global kernel
+//each work-item loads and stores VEC_WIDTH pixels at a time (vloadN / vstoreN) so wide memory paths are kept busy
+template<typename CIMG_TYPE>
+class VectorGlobalKernel : public GlobalKernel<CIMG_TYPE>
+{
+public:
+	VectorGlobalKernel() : GlobalKernel<CIMG_TYPE>("Vectorised (Global)") {}
+	virtual ~VectorGlobalKernel() {}
+public:
+	//must be called before Run()
+	virtual void Init(cl::Program& program, CImg::CImg<CIMG_TYPE>& InputImage, CImg::CImg<CIMG_TYPE>& OutputImage,
+		cl::CommandQueue& Queue, DeviceLease DeviceImage, DevicePool& Pool, int num_bins, int workgroup_size, int vector_width, bool ignoreColour, bool displayHistograms) override
+	{
+		GlobalKernel<CIMG_TYPE>::Init(program, InputImage, OutputImage, Queue, DeviceImage, Pool, num_bins, workgroup_size, vector_width, ignoreColour, displayHistograms);
+		cl::Buffer& Image = *this->Image;
+		cl::Buffer& HistogramA = *this->HistogramA;
+
+		this->histogramKernel = cl::Kernel(program, "createHistogram_Global_Vec");
+		this->histogramKernel.setArg(0, Image);
+		this->histogramKernel.setArg(1, HistogramA);
+
+		this->lookupKernel = cl::Kernel(program, "ApplyHistogram_Vec");
+		this->lookupKernel.setArg(0, Image);
+		this->lookupKernel.setArg(1, HistogramA);
+	}
+protected:
+	virtual void EnqueueHistogram(size_t offset, size_t imageSize) override {
+		this->EnqueueVectorised(this->histogramKernel, 2, offset, imageSize, true);
+	}
+	virtual void EnqueueApply(size_t offset, size_t imageSize) override {
+		this->EnqueueVectorised(this->lookupKernel, 2, offset, imageSize);
+	}
+};
+
+//vectorised version of the local kernel
+template<typename CIMG_TYPE>
+class VectorLocalKernel : public LocalKernel<CIMG_TYPE>
+{
+public:
+	VectorLocalKernel() : LocalKernel<CIMG_TYPE>("Vectorised (Local)") {}
+	virtual ~VectorLocalKernel() {}
+public:
+	//must be called before Run()
+	virtual void Init(cl::Program& program, CImg::CImg<CIMG_TYPE>& InputImage, CImg::CImg<CIMG_TYPE>& OutputImage,
+		cl::CommandQueue& Queue, DeviceLease DeviceImage, DevicePool& Pool, int num_bins, int workgroup_size, int vector_width, bool ignoreColour, bool displayHistograms) override
+	{
+		LocalKernel<CIMG_TYPE>::Init(program, InputImage, OutputImage, Queue, DeviceImage, Pool, num_bins, workgroup_size, vector_width, ignoreColour, displayHistograms);
+		cl::Buffer& Image = *this->Image;
+		cl::Buffer& HistogramA = *this->HistogramA;
+
+		this->histogramKernel = cl::Kernel(program, "createHistogram_Vec");
+		this->histogramKernel.setArg(0, Image);
+		this->histogramKernel.setArg(1, HistogramA);
+		this->histogramKernel.setArg(2, cl::Local(sizeof(LOCAL_HIST_TYPE) * num_bins));
+
+		this->lookupKernel = cl::Kernel(program, "ApplyHistogram_Vec");
+		this->lookupKernel.setArg(0, Image);
+		this->lookupKernel.setArg(1, HistogramA);
+	}
+protected:
+	virtual void EnqueueHistogram(size_t offset, size_t imageSize) override {
+		this->EnqueueVectorised(this->histogramKernel, 3, offset, imageSize, true);
+	}
+	virtual void EnqueueApply(size_t offset, size_t imageSize) override {
+		this->EnqueueVectorised(this->lookupKernel, 2, offset, imageSize);
+	}
+};
+
+//local kernel with R replicated copies of the local histogram to reduce atomic contention on images dominated by one value
+//R is the largest number of copies that fits in local memory, capped at maxReplicas
+template<typename CIMG_TYPE>
+class ReplicatedKernel : public LocalKernel<CIMG_TYPE>
+{
+public:
+	ReplicatedKernel() : LocalKernel<CIMG_TYPE>("Replicated (Local)") {}
+	virtual ~ReplicatedKernel() {}
+protected:
+	//past this point the merge costs more than the contention it saves
+	static const cl_uint maxReplicas = 16;
+	cl_uint replicas = 1;
+public:
+	//must be called before Run()
+	virtual void Init(cl::Program& program, CImg::CImg<CIMG_TYPE>& InputImage, CImg::CImg<CIMG_TYPE>& OutputImage,
+		cl::CommandQueue& Queue, DeviceLease DeviceImage, DevicePool& Pool, int num_bins, int workgroup_size, int vector_width, bool ignoreColour, bool displayHistograms) override
+	{
+		LocalKernel<CIMG_TYPE>::Init(program, InputImage, OutputImage, Queue, DeviceImage, Pool, num_bins, workgroup_size, vector_width, ignoreColour, displayHistograms);
+		cl::Buffer& Image = *this->Image;
+		cl::Buffer& HistogramA = *this->HistogramA;
+
+		cl::Device device = Queue.getInfo<CL_QUEUE_DEVICE>();
+		cl_ulong localMemory = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+		cl_ulong histogramBytes = sizeof(LOCAL_HIST_TYPE) * num_bins;
+		replicas = (cl_uint)std::min<cl_ulong>({ localMemory / histogramBytes, (cl_ulong)maxReplicas, (cl_ulong)workgroup_size });
+		if (replicas == 0) replicas = 1; //let the launch fail with the usual out of resources error rather than dividing by 0
+
+		this->histogramKernel = cl::Kernel(program, "createHistogram_Replicated");
+		this->histogramKernel.setArg(0, Image);
+		this->histogramKernel.setArg(1, HistogramA);
+		this->histogramKernel.setArg(2, cl::Local(histogramBytes * replicas));
+		this->histogramKernel.setArg(3, replicas);
+	}
+	cl_uint GetReplicas() const { return replicas; }
+protected:
+	virtual void EnqueueHistogram(size_t offset, size_t imageSize) override {
+		this->EnqueuePerPixel(this->histogramKernel, 4, offset, imageSize, true);
+	}
+};
+
+//local kernel for bin counts too large for one local histogram (e.g. full range 16 bit, 65536 bins)
+//if the whole histogram fits in local memory it uses the grid-stride kernel, otherwise the bin space is split into slices that do fit
+//and each slice gets its own set of persistent groups (2-D launch) that only count the pixels falling in that slice
+template<typename CIMG_TYPE>
+class HighBinKernel : public GridStrideKernel<CIMG_TYPE>
+{
+public:
+	HighBinKernel() : GridStrideKernel<CIMG_TYPE>("High bin count (Local)") {}
+	virtual ~HighBinKernel() {}
+protected:
+	cl_uint num_slices = 1;
+	cl_uint slice_bins = 0;
+public:
+	//must be called before Run()
+	virtual void Init(cl::Program& program, CImg::CImg<CIMG_TYPE>& InputImage, CImg::CImg<CIMG_TYPE>& OutputImage,
+		cl::CommandQueue& Queue, DeviceLease DeviceImage, DevicePool& Pool, int num_bins, int workgroup_size, int vector_width, bool ignoreColour, bool displayHistograms) override
+	{
+		//the grid-stride kernel with the whole histogram privatised per group, if it fits
+		GridStrideKernel<CIMG_TYPE>::Init(program, InputImage, OutputImage, Queue, DeviceImage, Pool, num_bins, workgroup_size, vector_width, ignoreColour, displayHistograms);
+		cl::Buffer& Image = *this->Image;
+		cl::Buffer& HistogramA = *this->HistogramA;
+		cl::Kernel& privatised = this->histogramKernel;
+
+		//the kernels' own local usage (the compiler's arrays and spills) comes out of the same budget as the histogram
+		cl::Device device = Queue.getInfo<CL_QUEUE_DEVICE>();
+		cl_ulong localSize = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+		if (privatised.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device) <= localSize) {
+			num_slices = 1;
+			slice_bins = num_bins;
+			this->kernelName += " [privatised]";
+			return;
+		}
+		//queried before the slice is bound, so it is only what the kernel needs besides it
+		cl::Kernel partitioned(program, "createHistogram_Partitioned");
+		cl_ulong used = partitioned.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+		cl_ulong localBins = (localSize > used ? localSize - used : 0) / sizeof(LOCAL_HIST_TYPE);
+		//largest power of 2 slice that fits, so the slices tile the (power of 2) bin range evenly
+		slice_bins = 1;
+		while ((cl_ulong)slice_bins * 2 <= localBins) slice_bins *= 2;
+		num_slices = (num_bins + slice_bins - 1) / slice_bins;
+		this->histogramKernel = partitioned;
+		this->histogramKernel.setArg(0, Image);
+		this->histogramKernel.setArg(1, HistogramA);
+		this->histogramKernel.setArg(2, cl::Local(sizeof(LOCAL_HIST_TYPE) * slice_bins));
+		this->histogramKernel.setArg(3, slice_bins);
+		this->kernelName += " [partitioned into " + std::to_string(num_slices) + " slices of " + std::to_string(slice_bins) + " bins]";
+	}
+protected:
+	virtual void EnqueueHistogram(size_t offset, size_t imageSize) override {
+		if (num_slices == 1) {
+			GridStrideKernel<CIMG_TYPE>::EnqueueHistogram(offset, imageSize);
+			return;
+		}
+		size_t workgroup_size = this->workgroup_size;
+		//each slice re-reads the channel, so spread the persistent groups across the slices rather than multiplying them
+		size_t groups = std::max<size_t>(1, std::min(this->num_groups / num_slices, (imageSize + workgroup_size - 1) / workgroup_size));
+		this->histogramKernel.setArg(4, (cl_ulong)imageSize);
+		this->EnqueueKernel(this->histogramKernel, cl::NDRange(offset, 0), cl::NDRange(groups * workgroup_size, num_slices), cl::NDRange(workgroup_size, 1), true);
+	}
+};
+
+//colour-fused kernel -- every channel goes through each step in a single launch over a 2-D (pixel/bin, channel) range
+//so an RGB image costs the same number of launches (and host sync points) as a greyscale one
+//owns its own spectrum * num_bins histogram buffer, since the shared ones only hold a single channel
+template<typename CIMG_TYPE>
+class ColourFusedKernel : public ImageProcessorKernel<CIMG_TYPE>
+{
+public:
+	ColourFusedKernel() : ImageProcessorKernel<CIMG_TYPE>("Colour fused (Local)") {}
+	virtual ~ColourFusedKernel() {}
+	bool HandlesInterleaved() const override { return true; }
+protected:
+	//kernels of each algorithm step
+	cl::Kernel histogramKernel;
+	cl::Kernel accumulateKernel;
+	cl::Kernel normalizeKernel;
+	cl::Kernel lookupKernel;
+	//all channels' histograms back to back
+	cl::Buffer ColourHistograms;
+	//the normalised histograms, kept apart so every group of the normalise launch reads the unchanged totals
+	cl::Buffer ColourNormal;
+	int channels = 1;
+public:
+	//must be called before Run()
+	virtual void Init(cl::Program& program, CImg::CImg<CIMG_TYPE>& InputImage, CImg::CImg<CIMG_TYPE>& OutputImage,
+		cl::CommandQueue& Queue, DeviceLease DeviceImage, DevicePool& Pool, int num_bins, int workgroup_size, int vector_width, bool ignoreColour, bool displayHistograms) override
+	{
+		ImageProcessorKernel<CIMG_TYPE>::Init(program, InputImage, OutputImage, Queue, DeviceImage, Pool, num_bins, workgroup_size, vector_width, ignoreColour, displayHistograms);
+		cl::Buffer& Image = *this->Image;
+		//pooled channels are one channel whatever the layout
+		bool interleaved = this->interleavedChannels > 1 && !ignoreColour;
+		channels = ignoreColour ? 1 : interleaved ? this->interleavedChannels : InputImage.spectrum();
+		size_t channelSize = InputImage.size() / channels;
+		cl_ulong channelStride = interleaved ? 1 : channelSize;
+		cl_ulong pixelStride = interleaved ? channels : 1;
+		ColourHistograms = this->Acquire(channels * num_bins * this->hist_size);
+		ColourNormal = this->Acquire(channels * num_bins * this->hist_size);
+		//graphs show the first channel
+		this->HistogramA = &ColourHistograms;
+
+		histogramKernel = cl::Kernel(program, "createHistogram_Colour");
+		histogramKernel.setArg(0, Image);
+		histogramKernel.setArg(1, ColourHistograms);
+		histogramKernel.setArg(2, cl::Local(sizeof(LOCAL_HIST_TYPE) * num_bins));
+		histogramKernel.setArg(3, (cl_ulong)channelSize);
+		histogramKernel.setArg(4, channelStride);
+		histogramKernel.setArg(5, pixelStride);
+
+		accumulateKernel = cl::Kernel(program, "AccumulateHistogram_Colour");
+		accumulateKernel.setArg(0, ColourHistograms);
+		accumulateKernel.setArg(1, cl::Local(this->hist_size * workgroup_size));
+		accumulateKernel.setArg(2, cl::Local(this->hist_size * workgroup_size));
+
+		normalizeKernel = cl::Kernel(program, "NormalizeHistogram_Colour");
+		normalizeKernel.setArg(0, ColourHistograms);
+		normalizeKernel.setArg(1, ColourNormal);
+
+		lookupKernel = cl::Kernel(program, "ApplyHistogram_Colour");
+		lookupKernel.setArg(0, Image);
+		lookupKernel.setArg(1, ColourNormal);
+		lookupKernel.setArg(2, (cl_ulong)channelSize);
+		lookupKernel.setArg(3, channelStride);
+		lookupKernel.setArg(4, pixelStride);
+	}
+public:
+	//Publicly accessible functions
+	virtual cl::Event Run(const cl::Event& after) override
+	{
+		auto InputImage = this->InputImage;
+		auto num_bins = this->num_bins;
+		auto workgroup_size = this->workgroup_size;
+
+		size_t imageSize = InputImage->size() / channels;
+		size_t imageGlobalSize = ((imageSize + workgroup_size - 1) / workgroup_size) * workgroup_size;
+		size_t histGlobalSize = ((num_bins + workgroup_size - 1) / workgroup_size) * workgroup_size;
+
+		this->EnqueueUpload(after);
+		//one clear and one launch per step for all channels
+		this->EnqueueFill(ColourHistograms, channels * num_bins * this->hist_size);
+		this->EnqueueKernel(histogramKernel, cl::NullRange, cl::NDRange(imageGlobalSize, channels), cl::NDRange(workgroup_size, 1), true);
+		this->ShowHistogram("ColourBaseHistogram");
+		this->EnqueueKernel(accumulateKernel, cl::NullRange, cl::NDRange(workgroup_size, channels), cl::NDRange(workgroup_size, 1));
+		this->ShowHistogram("ColourCumulativeHistogram");
+		this->EnqueueKernel(normalizeKernel, cl::NullRange, cl::NDRange(histGlobalSize, channels), cl::NDRange(workgroup_size, 1));
+		this->ShowHistogram("ColourNormalHistogram", &ColourNormal);
+		this->EnqueueKernel(lookupKernel, cl::NullRange, cl::NDRange(imageGlobalSize, channels), cl::NDRange(workgroup_size, 1));
+		return this->EnqueueDownload();
+	}
+};
+
+//histogram, scan and normalise in a single launch (createHistogram_Fused) -- the last group to flush builds the LUT
+//leaves two launches per channel (fused histogram + apply), which is what matters for small images where launch overhead dominates
+//needs the whole histogram twice in local memory (counts + cumulative) so it is only used for small bin counts
+template<typename CIMG_TYPE>
+class FusedKernel : public ImageProcessorKernel<CIMG_TYPE>
+{
+public:
+	FusedKernel() : ImageProcessorKernel<CIMG_TYPE>("Fused histogram-LUT (Local)") {}
+	virtual ~FusedKernel() {}
+	//local memory needed for a given bin count, with hist_size bytes per scanned bin as Init binds them
+	static size_t LocalMemorySize(int num_bins, int workgroup_size, size_t hist_size) {
+		return (sizeof(LOCAL_HIST_TYPE) + hist_size) * num_bins + hist_size * workgroup_size * 2;
+	}
+protected:
+	static const int groupsPerComputeUnit = 4;
+	size_t num_groups = 1;
+	//kernels of each algorithm step
+	cl::Kernel fusedKernel;
+	cl::Kernel lookupKernel;
+	//last-group-done counter, reset by the kernel itself
+	cl::Buffer Ticket;
+public:
+	//must be called before Run()
+	virtual void Init(cl::Program& program, CImg::CImg<CIMG_TYPE>& InputImage, CImg::CImg<CIMG_TYPE>& OutputImage,
+		cl::CommandQueue& Queue, DeviceLease DeviceImage, DevicePool& Pool, int num_bins, int workgroup_size, int vector_width, bool ignoreColour, bool displayHistograms) override
+	{
+		ImageProcessorKernel<CIMG_TYPE>::Init(program, InputImage, OutputImage, Queue, DeviceImage, Pool, num_bins, workgroup_size, vector_width, ignoreColour, displayHistograms);
+		cl::Buffer& Image = *this->Image;
+		cl::Buffer& HistogramA = *this->HistogramA;
+		cl::Buffer& HistogramB = *this->HistogramB;
+		Ticket = this->Acquire(sizeof(cl_uint));
+
+		//counts go to HistogramB, the finished LUT to HistogramA (so graphs show the LUT)
+		fusedKernel = cl::Kernel(program, "createHistogram_Fused");
+		fusedKernel.setArg(0, Image);
+		fusedKernel.setArg(1, HistogramB);
+		fusedKernel.setArg(2, HistogramA);
+		fusedKernel.setArg(3, Ticket);
+		fusedKernel.setArg(4, cl::Local(sizeof(LOCAL_HIST_TYPE) * num_bins));
+		fusedKernel.setArg(5, cl::Local(this->hist_size * num_bins));
+		fusedKernel.setArg(6, cl::Local(this->hist_size * workgroup_size));
+		fusedKernel.setArg(7, cl::Local(this->hist_size * workgroup_size));
+
+		lookupKernel = cl::Kernel(program, "ApplyHistogram");
+		lookupKernel.setArg(0, Image);
+		lookupKernel.setArg(1, HistogramA);
+
+		cl::Device device = Queue.getInfo<CL_QUEUE_DEVICE>();
+		num_groups = (size_t)device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * groupsPerComputeUnit;
+	}
+public:
+	//Publicly accessible functions
+	virtual cl::Event Run(const cl::Event& after) override
+	{
+		auto InputImage = this->InputImage;
+		auto num_bins = this->num_bins;
+		size_t workgroup_size = this->workgroup_size;
+
+		int targetSpectrum = this->ignoreColour ? 1 : InputImage->spectrum();
+		size_t imageSize = InputImage->size() / targetSpectrum;
+		size_t groups = std::min(num_groups, (imageSize + workgroup_size - 1) / workgroup_size);
+		fusedKernel.setArg(8, (cl_ulong)imageSize);
+
+		this->EnqueueUpload(after);//initial copy
+		//cleared once per run -- after that the kernel leaves them cleared for the next channel
+		this->EnqueueFill(*this->HistogramB, num_bins * this->hist_size);
+		this->EnqueueFill(Ticket, sizeof(cl_uint));
 		for (int col = 0; col < targetSpectrum; col++) {
-			//clear hist
-			Queue->enqueueFillBuffer<HIST_TYPE>(*HistogramA, 0, 0, num_bins * sizeof(HIST_TYPE));
-			Queue->enqueueFillBuffer<HIST_TYPE>(*HistogramB, 0, 0, num_bins * sizeof(HIST_TYPE));
-
-			//run kernels -- offset so that each colour runs separately
-			Queue->enqueueNDRangeKernel(histogramKernel, col * imageSize, cl::NDRange(imageSize + imageExtraThreads), cl::NDRange(workgroup_size), nullptr, &histogramEvent);
-			this->ShowHistogram("LocalBaseHistogram");
-			Queue->enqueueNDRangeKernel(accumulate1Kernel, cl::NullRange, num_bins + histExtraThreads, cl::NDRange(workgroup_size), nullptr, &accumulate1Event);
-			Queue->enqueueNDRangeKernel(accumulate2Kernel, cl::NullRange, num_bins + histExtraThreads, cl::NDRange(workgroup_size), nullptr, &accumulate2Event);
-			this->ShowHistogram("LocalCumulativeHistogram");
-			Queue->enqueueNDRangeKernel(normalizeKernel, cl::NullRange, num_bins + histExtraThreads, cl::NDRange(workgroup_size), nullptr, &normalizeEvent);
-			this->ShowHistogram("LocalNormalHistogram");
-			Queue->enqueueNDRangeKernel(lookupKernel, col * imageSize, cl::NDRange(imageSize + imageExtraThreads), cl::NDRange(workgroup_size), nullptr, &lookupEvent);
-			if (!print) continue;
-			lookupEvent.wait();//this does mean runs with profiling will be somewhat slower but its not measured
-			for (const cl::Event& event : { histogramEvent,accumulate1Event,accumulate2Event,normalizeEvent,lookupEvent }) {
-				kernelTotalTime += event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			//the histogram time here includes the scan and normalise
+			this->EnqueueKernel(fusedKernel, col * imageSize, cl::NDRange(groups * workgroup_size), cl::NDRange(workgroup_size), true);
+			this->ShowHistogram("FusedNormalHistogram");
+			this->EnqueuePerPixel(lookupKernel, 2, col * imageSize, imageSize);
+		}
+		return this->EnqueueDownload();
+	}
+};
+
+//the local pipeline with every channel on its own queue and its own histograms, so the channels of a colour image can run side by side
+//(the plain local kernel runs them one after another through the one HistogramA/HistogramB pair)
+//the upload and the read back stay on the main queue -- every channel waits on the upload, the read back waits on every channel
+template<typename CIMG_TYPE>
+class ChannelQueuesKernel : public LocalKernel<CIMG_TYPE>
+{
+public:
+	ChannelQueuesKernel() : LocalKernel<CIMG_TYPE>("Channel queues (Local)") {}
+	virtual ~ChannelQueuesKernel() {}
+protected:
+	struct Channel {
+		cl::CommandQueue queue;
+		cl::Buffer histogramA;
+		cl::Buffer histogramB;
+		cl::Buffer blockSums;
+		cl::Buffer lookBackStatus;
+		cl::Buffer lut;
+		//this channel's entries in kernelEvents, for the overlap report
+		size_t firstEvent = 0;
+		size_t endEvent = 0;
+	};
+	std::vector<Channel> channels;
+public:
+	//must be called before Run()
+	virtual void Init(cl::Program& program, CImg::CImg<CIMG_TYPE>& InputImage, CImg::CImg<CIMG_TYPE>& OutputImage,
+		cl::CommandQueue& Queue, DeviceLease DeviceImage, DevicePool& Pool, int num_bins, int workgroup_size, int vector_width, bool ignoreColour, bool displayHistograms) override
+	{
+		LocalKernel<CIMG_TYPE>::Init(program, InputImage, OutputImage, Queue, DeviceImage, Pool, num_bins, workgroup_size, vector_width, ignoreColour, displayHistograms);
+		int count = ignoreColour ? 1 : InputImage.spectrum();
+		cl::Context context = Queue.getInfo<CL_QUEUE_CONTEXT>();
+		cl::Device device = Queue.getInfo<CL_QUEUE_DEVICE>();
+		cl_command_queue_properties properties = Queue.getInfo<CL_QUEUE_PROPERTIES>();
+		channels.clear();
+		for (int col = 0; col < count; col++) {
+			Channel channel;
+			channel.queue = cl::CommandQueue(context, device, properties);
+			if (col == 0) {
+				//the first channel uses the set LocalKernel::Init leased
+				channel.histogramA = *this->HistogramA;
+				channel.histogramB = *this->HistogramB;
+				channel.blockSums = this->BlockSums;
+				channel.lookBackStatus = this->LookBackStatus;
+				channel.lut = this->Lut;
+			}
+			else {
+				channel.histogramA = this->Acquire(num_bins * this->hist_size);
+				channel.histogramB = this->Acquire(num_bins * this->hist_size);
+				channel.blockSums = this->Acquire(this->ScanBlocks() * this->hist_size);
+				if (this->useLookBack) channel.lookBackStatus = this->Acquire((this->ScanBlocks() + 1) * sizeof(cl_ulong));
+				channel.lut = this->Acquire(sizeof(CIMG_TYPE) * num_bins);
 			}
+			channels.push_back(channel);
 		}
-		Queue->enqueueReadBuffer(*ImageBuffer, CL_TRUE, 0, OutputImage->size() * sizeof(CIMG_TYPE), &OutputImage->data()[0], nullptr, &outputCopyEvent);
-		if (!print) return;
+		if (count > 1) this->kernelName += " [" + std::to_string(count) + " queues]";
+	}
+public:
+	//Publicly accessible functions
+	virtual cl::Event Run(const cl::Event& after) override
+	{
+		auto InputImage = this->InputImage;
+		int targetSpectrum = (int)channels.size();
+		size_t imageSize = InputImage->size() / targetSpectrum;
+		cl::CommandQueue* mainQueue = this->Queue;
+
+		this->EnqueueUpload(after);//initial copy
+		cl::Event uploaded = this->chain[0]; //the copy, or the byte swap after it
+		mainQueue->flush(); //the channel queues wait on uploaded, which only happens once its own queue has been flushed
+		std::vector<cl::Event> channelsDone;
+		for (int col = 0; col < targetSpectrum; col++) {
+			//swap the channel's queue and buffers in -- kernel arguments are captured when each command is enqueued
+			UseChannel(col);
+			this->chain = { uploaded };
+			channels[col].firstEvent = this->kernelEvents.size();
+			this->EnqueueChannel(col * imageSize, imageSize);
+			channels[col].endEvent = this->kernelEvents.size();
+			channelsDone.push_back(this->chain[0]);
+			channels[col].queue.flush(); //start this channel before the next is enqueued
+		}
+		UseChannel(0);
+		this->Queue = mainQueue;
+		this->chain = channelsDone;
+		return this->EnqueueDownload();
+	}
+	//the usual times, plus how much of the channels' kernel time overlapped
+	//each channel's span runs from its first kernel starting to its last ending -- 0% when they ran one after another, 100% when
+	//the whole image took no longer than the slowest channel
+	virtual void ReportProfiling() override {
+		ImageProcessorKernel<CIMG_TYPE>::ReportProfiling();
+		if (channels.size() < 2) return;
+		cl_ulong spans = 0;
+		cl_ulong longest = 0;
+		cl_ulong first = ULLONG_MAX;
+		cl_ulong last = 0;
+		for (const Channel& channel : channels) {
+			if (channel.firstEvent == channel.endEvent) continue;
+			cl_ulong start = this->kernelEvents[channel.firstEvent].template getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			cl_ulong end = this->kernelEvents[channel.endEvent - 1].template getProfilingInfo<CL_PROFILING_COMMAND_END>();
+			spans += end - start;
+			longest = std::max(longest, end - start);
+			first = std::min(first, start);
+			last = std::max(last, end);
+		}
+		cl_ulong wall = last > first ? last - first : 0;
+		double overlap = spans > longest ? 100.0 * (double)(spans - std::min(spans, std::max(wall, longest))) / (double)(spans - longest) : 0.0;
 		std::cout
-			<< "Copy host-to-device time [ns]: "
-			<< inputCopyEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - inputCopyEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "\n"
-			<< "Kernel execution time [ns]: "
-			<< kernelTotalTime << "\n"
-			<< "Copy device-to-host time [ns]: "
-			<< outputCopyEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - outputCopyEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>()
+			<< "Channel spans summed [ns]: " << spans << "  all channels [ns]: " << wall << "\n"
+			<< "Channel overlap: " << overlap << "%"
 			<< std::endl;
 	}
+protected:
+	void UseChannel(int col) {
+		Channel& channel = channels[col];
+		this->Queue = &channel.queue;
+		this->HistogramA = &channel.histogramA;
+		this->HistogramB = &channel.histogramB;
+		this->BlockSums = channel.blockSums;
+		this->LookBackStatus = channel.lookBackStatus;
+		this->Lut = channel.lut;
+		this->BindChannelBuffers(channel.histogramA, channel.histogramB, channel.blockSums, channel.lookBackStatus, channel.lut);
+	}
 };
-
@@ -0,0 +1,158 @@
+#pragma once
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+//binary PGM/PPM (P5/P6) files mapped straight into memory, so the pixels go from the page cache to the device without CImg parsing
+//them into a buffer of its own first -- the pixel region is wrapped in a shared CImg, which the upload reads from directly
+//output files are created at their final size and mapped too, so the read back writes the result file in place
+//16 bit samples stay big-endian as in the file, the kernels swap them on the device (see SetByteSwap)
+//posix only -- elsewhere Open/Create fail and the caller falls back to CImg
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//the header of a binary PGM/PPM file, shared by the mapped files here and the streamed ones (see TiledProcessor.h)
+struct PnmHeader
+{
+	char type = '5';
+	int width = 0;
+	int height = 0;
+	int maxval = 255;
+	size_t size = 0; //bytes up to the first sample
+
+	int Channels() const { return type == '6' ? 3 : 1; }
+	int BytesPerSample() const { return maxval > 255 ? 2 : 1; }
+	size_t RowSamples() const { return (size_t)width * Channels(); }
+	size_t PixelBytes() const { return RowSamples() * height * BytesPerSample(); }
+
+	//"P5"/"P6", then width, height and maxval separated by whitespace or # comments, then exactly one whitespace before the samples
+	bool Parse(const unsigned char* data, size_t length) {
+		if (length < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '6')) return false;
+		type = data[1];
+		size_t position = 2;
+		int values[3];
+		for (int& value : values) {
+			while (position < length && (std::isspace(data[position]) || data[position] == '#')) {
+				if (data[position] == '#') while (position < length && data[position] != '\n') position++;
+				else position++;
+			}
+			if (position >= length || !std::isdigit(data[position])) return false;
+			value = 0;
+			while (position < length && std::isdigit(data[position])) value = value * 10 + (data[position++] - '0');
+		}
+		if (position >= length || !std::isspace(data[position])) return false;
+		width = values[0];
+		height = values[1];
+		maxval = values[2];
+		size = position + 1;
+		return width > 0 && height > 0 && maxval > 0 && maxval < 65536;
+	}
+	//the header of an equalised copy -- the kernels stretch samples over the whole 8 or 16 bit range, so maxval has to cover it
+	//whatever the input declared (e.g. 4095 for 12 bit data)
+	PnmHeader Equalised() const {
+		PnmHeader header = *this;
+		header.maxval = BytesPerSample() == 2 ? 65535 : 255;
+		return header;
+	}
+	//a header with the same type, size and maxval -- padded with spaces before maxval (any whitespace is allowed there) to a
+	//multiple of alignment bytes, so the samples start aligned when the file is mapped
+	std::string Text(size_t alignment = 1) const {
+		char dimensions[64];
+		char range[16];
+		std::snprintf(dimensions, sizeof(dimensions), "P%c\n%d %d\n", type, width, height);
+		std::snprintf(range, sizeof(range), "%d\n", maxval);
+		size_t length = std::strlen(dimensions) + std::strlen(range);
+		return dimensions + std::string((alignment - length % alignment) % alignment, ' ') + range;
+	}
+};
+
+class MappedPnm
+{
+public:
+	MappedPnm() {}
+	~MappedPnm() { Close(); }
+	MappedPnm(const MappedPnm& other) = delete;
+	MappedPnm& operator=(const MappedPnm& other) = delete;
+public:
+	//maps an existing file read only, false if it cannot be mapped or is not a P5/P6 file this can read
+	bool Open(const std::string& path) {
+#ifndef _WIN32
+		int file = open(path.c_str(), O_RDONLY);
+		if (file < 0) return false;
+		struct stat info;
+		if (fstat(file, &info) != 0 || info.st_size == 0) {
+			close(file);
+			return false;
+		}
+		void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		close(file); //the mapping keeps the file open
+		if (mapped == MAP_FAILED) return false;
+		data = (unsigned char*)mapped;
+		size = info.st_size;
+		//the whole image is read once front to back
+		madvise(data, size, MADV_SEQUENTIAL);
+		if (!header.Parse(data, size) || header.size + header.PixelBytes() > size) {
+			Close();
+			return false;
+		}
+		return true;
+#else
+		return false;
+#endif
+	}
+	//creates (or replaces) a file with the same kind of header as like, sized for all of its pixels and mapped read/write
+	bool Create(const std::string& path, const PnmHeader& like) {
+#ifndef _WIN32
+		header = like;
+		std::string text = header.Text(sampleAlignment);
+		header.size = text.size();
+		size_t total = header.size + header.PixelBytes();
+		int file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (file < 0) return false;
+		if (ftruncate(file, total) != 0) {
+			close(file);
+			return false;
+		}
+		void* mapped = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+		close(file);
+		if (mapped == MAP_FAILED) return false;
+		data = (unsigned char*)mapped;
+		size = total;
+		writable = true;
+		std::memcpy(data, text.data(), text.size());
+		return true;
+#else
+		return false;
+#endif
+	}
+	void Close() {
+#ifndef _WIN32
+		if (data == nullptr) return;
+		if (writable) msync(data, size, MS_ASYNC);
+		munmap(data, size);
+		data = nullptr;
+#endif
+	}
+
+	const PnmHeader& Header() const { return header; }
+	int Width() const { return header.width; }
+	int Height() const { return header.height; }
+	int Channels() const { return header.Channels(); }
+	int BytesPerSample() const { return header.BytesPerSample(); }
+	size_t PixelBytes() const { return header.PixelBytes(); }
+	//the samples, interleaved for P6, big-endian if 16 bit -- only aligned in files this wrote, an input's header can be any length
+	unsigned char* Pixels() const { return data + header.size; }
+	//created files start their samples this far into the (page aligned) mapping, which suits 16 bit samples and
+	//CL_MEM_USE_HOST_PTR buffers (CL_DEVICE_MEM_BASE_ADDR_ALIGN is at least 128 bytes on full profile devices)
+	static const size_t sampleAlignment = 128;
+protected:
+	unsigned char* data = nullptr;
+	size_t size = 0;
+	bool writable = false;
+	PnmHeader header;
+};
@@ -0,0 +1,241 @@
+#pragma once
+#include "ImageProcessor.h"
+#include <algorithm>
+//multi-device mode (-M) -- one image split across several devices, which can be on different platforms (e.g. one PoCL per socket)
+//every channel is cut into one contiguous shard per device, sized by how fast each device got through a calibration run
+//each device histograms its shard, the partial histograms are merged on the host and turned into the LUT there (the histogram is
+//tiny next to the image, so this costs less than another round trip through a device), then the LUT is sent to every device to apply
+//devices on different platforms cannot share a context, so the host syncs once after the histograms and once after the apply
+
+template<typename CIMG_TYPE>
+class MultiDeviceProcessor
+{
+public:
+	MultiDeviceProcessor(const std::vector<std::pair<int, int>>& device_ids, int _workgroup_size, int _num_bins, std::string& image_filename, std::string& kernel_folder, bool _ignoreColour)
+		:workgroup_size(_workgroup_size),
+		num_bins(_num_bins),
+		ignoreColour(_ignoreColour),
+		inputPath(image_filename)
+	{
+		inputImage = CImg::CImg<CIMG_TYPE>(image_filename.c_str());
+		outputImage.assign(inputImage.width(), inputImage.height(), inputImage.depth(), inputImage.spectrum());
+		channels = ignoreColour ? 1 : inputImage.spectrum();
+		channelSize = inputImage.size() / channels;
+		hist_size = HistTypeSize(inputImage.size());
+		Utils::AddAllSources(sources, kernel_folder);
+		//HIST_TYPE follows the whole image, so every device's partials can be added up as the same type
+		std::string options = GetBuildOptions<CIMG_TYPE>(num_bins, 16 / sizeof(CIMG_TYPE), inputImage.size());
+		for (const auto& [platform_id, device_id] : device_ids) {
+			Device device;
+			device.name = Utils::GetPlatformName(platform_id) + ", " + Utils::GetDeviceName(platform_id, device_id);
+			cl::Context context = Utils::GetContext(platform_id, device_id);
+			cl::Device clDevice = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+			device.context = context;
+			device.queue = cl::CommandQueue(context);
+			device.program = BuildProgram(context, sources, options);
+			//same rule as the single device mode -- local histograms where they fit
+			device.local = clDevice.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() >= sizeof(LOCAL_HIST_TYPE) * num_bins;
+			device.histogramKernel = cl::Kernel(device.program, device.local ? "createHistogram" : "createHistogram_Global");
+			device.applyKernel = cl::Kernel(device.program, "ApplyLUT_Global");
+			devices.push_back(device);
+			std::cout << "Device " << devices.size() - 1 << ": " << device.name << std::endl;
+		}
+	}
+	virtual ~MultiDeviceProcessor() {}
+public:
+	//"all" for every device on every platform, otherwise a comma separated list of platform:device pairs (e.g. 0:0,1:0)
+	static std::vector<std::pair<int, int>> ParseDevices(const std::string& list) {
+		std::vector<std::pair<int, int>> device_ids;
+		std::vector<cl::Platform> platforms;
+		cl::Platform::get(&platforms);
+		if (list == "all") {
+			for (int i = 0; i < (int)platforms.size(); i++) {
+				std::vector<cl::Device> platformDevices;
+				platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &platformDevices);
+				for (int j = 0; j < (int)platformDevices.size(); j++) device_ids.push_back({ i, j });
+			}
+			return device_ids;
+		}
+		std::stringstream entries(list);
+		std::string entry;
+		while (std::getline(entries, entry, ',')) {
+			size_t colon = entry.find(':');
+			if (colon == std::string::npos) {
+				std::cout << "Bad device " << entry << ", expected platform:device" << std::endl;
+				exit(1);
+			}
+			device_ids.push_back({ std::stoi(entry.substr(0, colon)), std::stoi(entry.substr(colon + 1)) });
+		}
+		return device_ids;
+	}
+
+	void Run() {
+		Calibrate();
+		std::chrono::time_point start = std::chrono::high_resolution_clock::now();
+		for (Device& device : devices) EnqueueHistograms(device);
+		//the partials have to be on the host before any LUT exists
+		for (Device& device : devices) {
+			if (device.shardSize > 0) device.done.wait();
+		}
+		std::chrono::time_point histogrammed = std::chrono::high_resolution_clock::now();
+		BuildLuts();
+		for (Device& device : devices) EnqueueApply(device);
+		for (Device& device : devices) {
+			if (device.shardSize > 0) device.done.wait();
+		}
+		std::chrono::time_point end = std::chrono::high_resolution_clock::now();
+
+		std::cout << "\nShards:" << std::endl;
+		for (size_t i = 0; i < devices.size(); i++) {
+			std::cout << "  device " << i << ": " << devices[i].shardSize << " of " << channelSize << " pixels per channel ("
+				<< (int)(100.0 * devices[i].shardSize / std::max<size_t>(channelSize, 1)) << "%), calibrated at "
+				<< devices[i].throughput / 1e6 << " Mpixel/s" << std::endl;
+		}
+		std::cout
+			<< "Histogram + merge time [ns]: " << std::chrono::duration_cast<std::chrono::nanoseconds>(histogrammed - start).count() << "\n"
+			<< "Total time [ns]: " << std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()
+			<< std::endl;
+	}
+	void Save() {
+		outputImage.save(("equalized_" + inputPath).c_str());
+	}
+protected:
+	struct Device {
+		std::string name;
+		cl::Context context;
+		cl::CommandQueue queue;
+		cl::Program program;
+		bool local;
+		cl::Kernel histogramKernel;
+		cl::Kernel applyKernel;
+		cl::Buffer image;
+		std::vector<cl::Buffer> histograms; //one per channel
+		std::vector<cl::Buffer> luts;
+		std::vector<std::vector<unsigned char>> partials; //host copies of the histograms, HIST_TYPE
+		double throughput = 0; //pixels per second in the calibration run
+		size_t shardStart = 0; //within each channel
+		size_t shardSize = 0;
+		cl::Event done;
+	};
+
+	//times one histogram of the same sample on every device (upload included, the shards will pay for it too), best of two so
+	//the first run's one-off costs do not count, then splits each channel in proportion to the measured throughputs
+	void Calibrate() {
+		size_t sampleSize = std::min<size_t>(channelSize, calibrationPixels);
+		for (Device& device : devices) {
+			device.shardStart = 0;
+			device.shardSize = sampleSize;
+			Allocate(device, 1);
+			double best = 0;
+			for (int run = 0; run < 2; run++) {
+				std::chrono::time_point start = std::chrono::high_resolution_clock::now();
+				EnqueueHistograms(device, 1);
+				device.done.wait();
+				std::chrono::time_point end = std::chrono::high_resolution_clock::now();
+				double seconds = std::chrono::duration<double>(end - start).count();
+				if (run == 0 || seconds < best) best = seconds;
+			}
+			device.throughput = sampleSize / std::max(best, 1e-9);
+		}
+		double total = 0;
+		for (Device& device : devices) total += device.throughput;
+		size_t start = 0;
+		for (size_t i = 0; i < devices.size(); i++) {
+			Device& device = devices[i];
+			size_t size = (i + 1 == devices.size()) ? channelSize - start : (size_t)(channelSize * (device.throughput / total));
+			device.shardStart = start;
+			device.shardSize = std::min(size, channelSize - start);
+			start += device.shardSize;
+			Allocate(device, channels);
+		}
+	}
+	void Allocate(Device& device, int shardChannels) {
+		device.histograms.clear();
+		device.luts.clear();
+		device.partials.assign(shardChannels, std::vector<unsigned char>(num_bins * hist_size));
+		if (device.shardSize == 0) return;
+		device.image = cl::Buffer(device.context, CL_MEM_READ_WRITE, device.shardSize * shardChannels * sizeof(CIMG_TYPE));
+		for (int col = 0; col < shardChannels; col++) {
+			device.histograms.push_back(cl::Buffer(device.context, CL_MEM_READ_WRITE, num_bins * hist_size));
+			device.luts.push_back(cl::Buffer(device.context, CL_MEM_READ_ONLY, num_bins * sizeof(CIMG_TYPE)));
+		}
+	}
+
+	//uploads the device's slice of every channel back to back, histograms each and reads the partials back, without blocking
+	void EnqueueHistograms(Device& device, int shardChannels = 0) {
+		if (shardChannels == 0) shardChannels = channels;
+		if (device.shardSize == 0) return;
+		cl::CommandQueue& queue = device.queue;
+		size_t shardBytes = device.shardSize * sizeof(CIMG_TYPE);
+		size_t globalSize = ((device.shardSize + workgroup_size - 1) / workgroup_size) * workgroup_size;
+		std::vector<cl::Event> chain(1);
+		for (int col = 0; col < shardChannels; col++) {
+			cl::Event uploaded, filled, histogrammed;
+			device.queue.enqueueWriteBuffer(device.image, CL_FALSE, col * shardBytes, shardBytes, inputImage.data() + col * channelSize + device.shardStart, col > 0 ? &chain : nullptr, &uploaded);
+			chain[0] = uploaded;
+			queue.enqueueFillBuffer<cl_uint>(device.histograms[col], 0, 0, num_bins * hist_size, &chain, &filled);
+			chain[0] = filled;
+			cl_uint arg = 0;
+			device.histogramKernel.setArg(arg++, device.image);
+			device.histogramKernel.setArg(arg++, device.histograms[col]);
+			if (device.local) device.histogramKernel.setArg(arg++, cl::Local(sizeof(LOCAL_HIST_TYPE) * num_bins));
+			device.histogramKernel.setArg(arg++, (cl_ulong)(col * device.shardSize));
+			device.histogramKernel.setArg(arg++, (cl_ulong)device.shardSize);
+			device.queue.enqueueNDRangeKernel(device.histogramKernel, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(workgroup_size), &chain, &histogrammed);
+			chain[0] = histogrammed;
+			device.queue.enqueueReadBuffer(device.histograms[col], CL_FALSE, 0, num_bins * hist_size, device.partials[col].data(), &chain, &device.done);
+			chain[0] = device.done;
+		}
+		device.queue.flush(); //start this device before the next one is enqueued
+	}
+	//sends the LUTs, applies them to the device's slices and reads the slices back into outputImage, without blocking
+	void EnqueueApply(Device& device) {
+		if (device.shardSize == 0) return;
+		size_t shardBytes = device.shardSize * sizeof(CIMG_TYPE);
+		size_t globalSize = ((device.shardSize + workgroup_size - 1) / workgroup_size) * workgroup_size;
+		std::vector<cl::Event> chain(1);
+		chain[0] = device.done;
+		for (int col = 0; col < channels; col++) {
+			cl::Event sent, applied;
+			device.queue.enqueueWriteBuffer(device.luts[col], CL_FALSE, 0, num_bins * sizeof(CIMG_TYPE), luts[col].data(), &chain, &sent);
+			chain[0] = sent;
+			device.applyKernel.setArg(0, device.image);
+			device.applyKernel.setArg(1, device.luts[col]);
+			device.applyKernel.setArg(2, (cl_ulong)(col * device.shardSize));
+			device.applyKernel.setArg(3, (cl_ulong)device.shardSize);
+			device.queue.enqueueNDRangeKernel(device.applyKernel, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(workgroup_size), &chain, &applied);
+			chain[0] = applied;
+			device.queue.enqueueReadBuffer(device.image, CL_FALSE, col * shardBytes, shardBytes, outputImage.data() + col * channelSize + device.shardStart, &chain, &device.done);
+			chain[0] = device.done;
+		}
+		device.queue.flush();
+	}
+
+	//merges the partials of each channel and does the cumulative + normalise steps on the host
+	void BuildLuts() {
+		luts.clear();
+		for (int col = 0; col < channels; col++) {
+			std::vector<unsigned long long> histogram(num_bins, 0);
+			for (Device& device : devices) {
+				if (device.shardSize > 0) AddPartialHistogram(histogram, device.partials[col], hist_size);
+			}
+			luts.push_back(HostLut<CIMG_TYPE>(histogram));
+		}
+	}
+
+	//large enough to cover launch overheads, small enough that calibrating is quick next to the real run
+	static const size_t calibrationPixels = 1 << 22;
+
+	int workgroup_size;
+	int num_bins;
+	bool ignoreColour;
+	int channels;
+	size_t channelSize;
+	size_t hist_size;
+	std::string inputPath;
+	cl::Program::Sources sources;
+	std::vector<Device> devices;
+	std::vector<std::vector<CIMG_TYPE>> luts;
+	CImg::CImg<CIMG_TYPE> inputImage;
+	CImg::CImg<CIMG_TYPE> outputImage;
+};
@@ -0,0 +1,98 @@
+#pragma once
+#include "Utils.h"
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+//on-disk cache of built program binaries -- building from source takes hundreds of ms on some platforms (PoCL) and happens for every
+//distinct set of build options, so a binary is stored per (device, driver, kernel sources, options) and loaded with CL_PROGRAM_BINARIES next time
+//entries live in ~/.cache/ParallelProgrammingAssessment (%LOCALAPPDATA% on windows), deleting the folder is always safe
+
+namespace ProgramCache {
+	//FNV-1a, 64 bit -- only used to name cache entries
+	inline uint64_t Hash(const std::string& data, uint64_t hash = 14695981039346656037ull) {
+		for (unsigned char c : data) {
+			hash ^= c;
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	inline std::filesystem::path Folder() {
+		const char* root = nullptr;
+#ifdef _WIN32
+		root = std::getenv("LOCALAPPDATA");
+		if (root != nullptr) return std::filesystem::path(root) / "ParallelProgrammingAssessment";
+#else
+		root = std::getenv("XDG_CACHE_HOME");
+		if (root != nullptr && root[0] != '\0') return std::filesystem::path(root) / "ParallelProgrammingAssessment";
+		root = std::getenv("HOME");
+		if (root != nullptr) return std::filesystem::path(root) / ".cache" / "ParallelProgrammingAssessment";
+#endif
+		return std::filesystem::temp_directory_path() / "ParallelProgrammingAssessment";
+	}
+
+	//the sources are hashed one by one and the hashes sorted, since AddAllSources does not promise a file order
+	inline std::filesystem::path EntryPath(const cl::Device& device, const cl::Program::Sources& sources, const std::string& options) {
+		std::vector<uint64_t> sourceHashes;
+		for (const auto& source : sources) sourceHashes.push_back(Hash(std::string(source.begin(), source.end())));
+		std::sort(sourceHashes.begin(), sourceHashes.end());
+		uint64_t hash = Hash(device.getInfo<CL_DEVICE_NAME>());
+		hash = Hash(device.getInfo<CL_DRIVER_VERSION>(), hash);
+		for (uint64_t sourceHash : sourceHashes) hash = Hash(std::to_string(sourceHash), hash);
+		hash = Hash(options, hash);
+		std::stringstream name;
+		name << std::hex << hash << ".bin";
+		return Folder() / name.str();
+	}
+
+	//false if there is no entry or the driver rejects it (e.g. after a driver update that kept the version string)
+	inline bool Load(cl::Context& context, const cl::Device& device, const std::filesystem::path& entry, const std::string& options, cl::Program& program) {
+		std::ifstream file(entry, std::ios::binary);
+		if (file.fail()) return false;
+		std::vector<unsigned char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		if (binary.empty()) return false;
+		try {
+			program = cl::Program(context, { device }, cl::Program::Binaries{ binary });
+			program.build(options.c_str()); //still needed for binaries, but only links
+		}
+		catch (const cl::Error&) {
+			return false;
+		}
+		return true;
+	}
+
+	//different for every Store of every running process -- the pid tells processes apart and the counter stores within one
+	inline std::string TemporarySuffix() {
+		static std::atomic<unsigned int> counter{ 0 };
+#ifdef _WIN32
+		long long pid = _getpid();
+#else
+		long long pid = getpid();
+#endif
+		return ".tmp" + std::to_string(pid) + "_" + std::to_string(counter++);
+	}
+
+	//failing to write is not an error, the next run just builds from source again
+	inline void Store(const cl::Program& program, const std::filesystem::path& entry) {
+		std::vector<std::vector<unsigned char>> binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+		if (binaries.empty() || binaries[0].empty()) return;
+		std::error_code error;
+		std::filesystem::create_directories(entry.parent_path(), error);
+		//written next to the entry then renamed so a concurrent run never loads half a file
+		std::filesystem::path temporary = entry;
+		temporary += TemporarySuffix();
+		{
+			std::ofstream file(temporary, std::ios::binary);
+			if (file.fail()) return;
+			file.write((const char*)binaries[0].data(), binaries[0].size());
+		}
+		std::filesystem::rename(temporary, entry, error);
+		if (error) std::filesystem::remove(temporary, error);
+	}
+}
@@ -0,0 +1,284 @@
+#pragma once
+#include "ImageProcessor.h"
+#include "MappedPnm.h"
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+//tiled mode (-T) -- for images too big to go to the device in one buffer (more than CL_DEVICE_MAX_MEM_ALLOC_SIZE, e.g. stitched microscopy)
+//pass 1 streams fixed size tiles of each channel through the histogram kernel, the histogram is read back and the LUT made on the host,
+//pass 2 streams the tiles again through the apply kernel and back out
+//two tile slots with a queue each are alternated, so one tile uploads while the other is being computed on, and device memory stays at
+//two tiles + two histograms + the LUTs however large the image is
+//streaming mode (-R) runs the same two passes over bands of rows read from and written to PGM/PPM files, so host memory stays at
+//the two slots' staging buffers as well
+
+//where tiles come from -- planar, channel by channel
+template<typename CIMG_TYPE>
+class TileSource
+{
+public:
+	virtual ~TileSource() {}
+	virtual int Channels() = 0;
+	virtual size_t ChannelSize() = 0;
+	//pixels [start, start + count) of a channel, either copied into staging or pointing straight at the source's own memory
+	//the returned pointer has to stay valid until the next Fetch into the same staging buffer
+	virtual const CIMG_TYPE* Fetch(int channel, size_t start, size_t count, CIMG_TYPE* staging) = 0;
+};
+//where equalised tiles go
+template<typename CIMG_TYPE>
+class TileSink
+{
+public:
+	virtual ~TileSink() {}
+	//memory for the device to read a tile back into -- staging, or the sink's own memory if it can take it directly
+	virtual CIMG_TYPE* Destination(int channel, size_t start, size_t count, CIMG_TYPE* staging) = 0;
+	//called once the read back into Destination has completed, data may be changed in place (e.g. byte swapped) before it is written out
+	virtual void Commit(int channel, size_t start, size_t count, CIMG_TYPE* data) {}
+};
+
+//a CImg already in host memory, read and written in place
+template<typename CIMG_TYPE>
+class ImageTileSource : public TileSource<CIMG_TYPE>
+{
+public:
+	ImageTileSource(CImg::CImg<CIMG_TYPE>& _image, bool ignoreColour) :image(_image), channels(ignoreColour ? 1 : _image.spectrum()) {}
+	int Channels() override { return channels; }
+	size_t ChannelSize() override { return image.size() / channels; }
+	const CIMG_TYPE* Fetch(int channel, size_t start, size_t count, CIMG_TYPE* staging) override {
+		return image.data() + channel * ChannelSize() + start;
+	}
+protected:
+	CImg::CImg<CIMG_TYPE>& image;
+	int channels;
+};
+template<typename CIMG_TYPE>
+class ImageTileSink : public TileSink<CIMG_TYPE>
+{
+public:
+	ImageTileSink(CImg::CImg<CIMG_TYPE>& _image, int _channels) :image(_image), channels(_channels) {}
+	CIMG_TYPE* Destination(int channel, size_t start, size_t count, CIMG_TYPE* staging) override {
+		return image.data() + channel * (image.size() / channels) + start;
+	}
+protected:
+	CImg::CImg<CIMG_TYPE>& image;
+	int channels;
+};
+
+//file samples are big-endian, swapped on the host here since the band is being copied through staging anyway
+template<typename CIMG_TYPE>
+void SwapSampleBytes(CIMG_TYPE* data, size_t count) {
+	if (sizeof(CIMG_TYPE) == 1) return;
+	for (size_t i = 0; i < count; i++) data[i] = (CIMG_TYPE)((data[i] >> 8) | (data[i] << 8));
+}
+
+//a binary PGM/PPM file read into staging one band at a time -- P6 samples stay interleaved, so a colour file is one pooled channel (like -c)
+template<typename CIMG_TYPE>
+class PnmFileSource : public TileSource<CIMG_TYPE>
+{
+public:
+	//false unless the file is P5/P6 with samples the size of CIMG_TYPE (headers with over 1KB of comments are not read)
+	bool Open(const std::string& path) {
+		file.open(path, std::ios::binary);
+		if (!file) return false;
+		unsigned char start[1024];
+		file.read((char*)start, sizeof(start));
+		size_t length = file.gcount();
+		file.clear(); //short files hit eof above
+		return header.Parse(start, length) && header.BytesPerSample() == sizeof(CIMG_TYPE);
+	}
+	const PnmHeader& Header() const { return header; }
+	int Channels() override { return 1; }
+	size_t ChannelSize() override { return header.RowSamples() * header.height; }
+	const CIMG_TYPE* Fetch(int channel, size_t start, size_t count, CIMG_TYPE* staging) override {
+		file.seekg(header.size + start * sizeof(CIMG_TYPE));
+		file.read((char*)staging, count * sizeof(CIMG_TYPE));
+		if ((size_t)file.gcount() != count * sizeof(CIMG_TYPE)) throw std::runtime_error("input file is shorter than its header says");
+		SwapSampleBytes(staging, count);
+		return staging;
+	}
+protected:
+	std::ifstream file;
+	PnmHeader header;
+};
+//the equalised bands written to a new file with the source's header
+template<typename CIMG_TYPE>
+class PnmFileSink : public TileSink<CIMG_TYPE>
+{
+public:
+	bool Create(const std::string& path, const PnmHeader& like) {
+		std::string text = like.Text();
+		file.open(path, std::ios::binary | std::ios::trunc);
+		file.write(text.data(), text.size());
+		headerSize = text.size();
+		return (bool)file;
+	}
+	CIMG_TYPE* Destination(int channel, size_t start, size_t count, CIMG_TYPE* staging) override {
+		return staging;
+	}
+	void Commit(int channel, size_t start, size_t count, CIMG_TYPE* data) override {
+		SwapSampleBytes(data, count);
+		//the slots can finish the last two bands in either order
+		file.seekp(headerSize + start * sizeof(CIMG_TYPE));
+		file.write((const char*)data, count * sizeof(CIMG_TYPE));
+		if (!file) throw std::runtime_error("could not write the output file");
+	}
+protected:
+	std::ofstream file;
+	size_t headerSize = 0;
+};
+
+template<typename CIMG_TYPE>
+class TiledProcessor
+{
+public:
+	TiledProcessor(int platform_id, int device_id, int _workgroup_size, int _num_bins, size_t _tile_pixels, std::string& kernel_folder)
+		:workgroup_size(_workgroup_size),
+		num_bins(_num_bins)
+	{
+		context = Utils::GetContext(platform_id, device_id);
+		Utils::AddAllSources(sources, kernel_folder);
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		//a tile has to fit in one allocation itself
+		tile_pixels = std::min<size_t>(_tile_pixels, device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() / sizeof(CIMG_TYPE));
+		local = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() >= sizeof(LOCAL_HIST_TYPE) * num_bins;
+		for (Slot& slot : slots) {
+			slot.queue = cl::CommandQueue(context);
+			slot.tile = cl::Buffer(context, CL_MEM_READ_WRITE, tile_pixels * sizeof(CIMG_TYPE));
+			slot.staging.resize(tile_pixels);
+		}
+	}
+	virtual ~TiledProcessor() {}
+public:
+	void Run(TileSource<CIMG_TYPE>& source, TileSink<CIMG_TYPE>& sink) {
+		int channels = source.Channels();
+		size_t channelSize = source.ChannelSize();
+		size_t tiles = (channelSize + tile_pixels - 1) / tile_pixels;
+		//HIST_TYPE follows the whole channel, tiles only ever add to the same histogram
+		hist_size = HistTypeSize(channelSize);
+		cl::Program program = BuildProgram(context, sources, GetBuildOptions<CIMG_TYPE>(num_bins, 16 / sizeof(CIMG_TYPE), channelSize));
+		cl::Kernel histogramKernel(program, local ? "createHistogram" : "createHistogram_Global");
+		cl::Kernel applyKernel(program, "ApplyLUT_Global");
+		std::chrono::time_point start = std::chrono::high_resolution_clock::now();
+
+		//pass 1 -- each slot keeps its own histogram so the two queues never add to the same buffer at once, they are merged on the host
+		std::vector<std::vector<CIMG_TYPE>> luts;
+		for (int col = 0; col < channels; col++) {
+			for (Slot& slot : slots) {
+				cl::CommandQueue& queue = slot.queue;
+				slot.histogram = cl::Buffer(context, CL_MEM_READ_WRITE, num_bins * hist_size);
+				queue.enqueueFillBuffer<cl_uint>(slot.histogram, 0, 0, num_bins * hist_size);
+			}
+			for (size_t t = 0; t < tiles; t++) {
+				Slot& slot = slots[t % slotCount];
+				size_t tileStart = t * tile_pixels;
+				size_t count = std::min(tile_pixels, channelSize - tileStart);
+				Wait(slot, sink);
+				Upload(slot, source.Fetch(col, tileStart, count, slot.staging.data()), count);
+				cl_uint arg = 0;
+				histogramKernel.setArg(arg++, slot.tile);
+				histogramKernel.setArg(arg++, slot.histogram);
+				if (local) histogramKernel.setArg(arg++, cl::Local(sizeof(LOCAL_HIST_TYPE) * num_bins));
+				histogramKernel.setArg(arg++, (cl_ulong)0);
+				histogramKernel.setArg(arg++, (cl_ulong)count);
+				Launch(slot, histogramKernel, count);
+			}
+			std::vector<unsigned long long> histogram(num_bins, 0);
+			std::vector<unsigned char> partial(num_bins * hist_size);
+			for (Slot& slot : slots) {
+				slot.queue.enqueueReadBuffer(slot.histogram, CL_TRUE, 0, num_bins * hist_size, partial.data());
+				slot.busy = false;
+				AddPartialHistogram(histogram, partial, hist_size);
+			}
+			luts.push_back(HostLut<CIMG_TYPE>(histogram));
+		}
+		std::chrono::time_point histogrammed = std::chrono::high_resolution_clock::now();
+
+		//pass 2 -- the LUTs are written once (blocking, so both queues see them) and the tiles streamed through again
+		std::vector<cl::Buffer> lutBuffers;
+		for (int col = 0; col < channels; col++) {
+			lutBuffers.push_back(cl::Buffer(context, CL_MEM_READ_ONLY, num_bins * sizeof(CIMG_TYPE)));
+			slots[0].queue.enqueueWriteBuffer(lutBuffers[col], CL_TRUE, 0, num_bins * sizeof(CIMG_TYPE), luts[col].data());
+		}
+		for (int col = 0; col < channels; col++) {
+			for (size_t t = 0; t < tiles; t++) {
+				Slot& slot = slots[t % slotCount];
+				size_t tileStart = t * tile_pixels;
+				size_t count = std::min(tile_pixels, channelSize - tileStart);
+				Wait(slot, sink);
+				Upload(slot, source.Fetch(col, tileStart, count, slot.staging.data()), count);
+				applyKernel.setArg(0, slot.tile);
+				applyKernel.setArg(1, lutBuffers[col]);
+				applyKernel.setArg(2, (cl_ulong)0);
+				applyKernel.setArg(3, (cl_ulong)count);
+				Launch(slot, applyKernel, count);
+				//in order queue, so reading back into staging is safe once the upload from it has been consumed
+				slot.output = { col, tileStart, count, sink.Destination(col, tileStart, count, slot.staging.data()) };
+				slot.queue.enqueueReadBuffer(slot.tile, CL_FALSE, 0, count * sizeof(CIMG_TYPE), slot.output.data, &slot.chain, &slot.done);
+				slot.queue.flush();
+				slot.busy = true;
+				slot.pendingOutput = true;
+			}
+		}
+		for (Slot& slot : slots) Wait(slot, sink);
+		std::chrono::time_point end = std::chrono::high_resolution_clock::now();
+
+		std::cout
+			<< "Tiled: " << tiles * channels << " tiles of up to " << tile_pixels << " pixels, " << slotCount << " slots\n"
+			<< "Device memory: " << (slotCount * (tile_pixels * sizeof(CIMG_TYPE) + num_bins * hist_size) + channels * num_bins * sizeof(CIMG_TYPE)) << " bytes\n"
+			<< "Pass 1 (histogram) time [ns]: " << std::chrono::duration_cast<std::chrono::nanoseconds>(histogrammed - start).count() << "\n"
+			<< "Total time [ns]: " << std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()
+			<< std::endl;
+	}
+protected:
+	struct PendingOutput {
+		int channel;
+		size_t start;
+		size_t count;
+		CIMG_TYPE* data;
+	};
+	struct Slot {
+		cl::CommandQueue queue;
+		cl::Buffer tile;
+		cl::Buffer histogram;
+		std::vector<CIMG_TYPE> staging;
+		std::vector<cl::Event> chain = std::vector<cl::Event>(1);
+		cl::Event done;
+		bool busy = false;
+		bool pendingOutput = false;
+		PendingOutput output;
+	};
+	//two is enough for an upload to overlap the other slot's kernel
+	static const int slotCount = 2;
+
+	//the slot's staging and tile are only reused once its last command has finished (and its output handed to the sink)
+	void Wait(Slot& slot, TileSink<CIMG_TYPE>& sink) {
+		if (!slot.busy) return;
+		slot.done.wait();
+		slot.busy = false;
+		if (slot.pendingOutput) {
+			sink.Commit(slot.output.channel, slot.output.start, slot.output.count, slot.output.data);
+			slot.pendingOutput = false;
+		}
+	}
+	void Upload(Slot& slot, const CIMG_TYPE* data, size_t count) {
+		cl::Event uploaded;
+		slot.queue.enqueueWriteBuffer(slot.tile, CL_FALSE, 0, count * sizeof(CIMG_TYPE), data, nullptr, &uploaded);
+		slot.chain[0] = uploaded;
+	}
+	void Launch(Slot& slot, cl::Kernel& kernel, size_t count) {
+		size_t globalSize = ((count + workgroup_size - 1) / workgroup_size) * workgroup_size;
+		slot.queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(workgroup_size), &slot.chain, &slot.done);
+		slot.chain[0] = slot.done;
+		slot.queue.flush(); //get the device going on this tile while the host fetches the next
+		slot.busy = true;
+	}
+
+	int workgroup_size;
+	int num_bins;
+	size_t tile_pixels;
+	size_t hist_size = sizeof(uint);
+	bool local;
+	cl::Program::Sources sources;
+	cl::Context context;
+	Slot slots[slotCount];
+};
@@ -231,12 +231,25 @@ namespace Utils {
 		std::cerr << "  -d : select device" << std::endl;
 		std::cerr << "  -w : set workgroup size (default 256)" << std::endl;
 		std::cerr << "  -b : set number of bins (default 256)" << std::endl;
+		std::cerr << "  -v : set vector width of the vectorised kernels, 2/3/4/8/16 (default: 16 bytes per load)" << std::endl;
+		std::cerr << "  -s : scan used by the accumulate step, default/blelloch (default: default)" << std::endl;
 		std::cerr << "  -i : input image file path (default: test.pgm)" << std::endl;
 		std::cerr << "  -t : hide kernel timing (default: shown)" << std::endl;
 		std::cerr << "  -g : show intermediate histogram graphs (default: hidden)" << std::endl;
 		std::cerr << "  -h : enable high (16) bit depth (default: disabled)" << std::endl;
 		std::cerr << "  -c : ignore colour images and treat them like greyscale (default: disabled)" << std::endl;
 		std::cerr << "  -f : input kernel folder path (default: kernels)" << std::endl;
+		std::cerr << "  -m : batch mode, equalise every image in a directory or list file (one path per line) instead of -i" << std::endl;
+		std::cerr << "  -o : output folder for batch mode (default: equalized)" << std::endl;
+		std::cerr << "  -T : tiled two pass mode with tiles of this many pixels (e.g. 16777216), for images larger than the device's largest buffer" << std::endl;
+		std::cerr << "  -R : streaming mode, tiled mode reading and writing the PGM/PPM file in bands of this many rows, for images larger than host memory" << std::endl;
+		std::cerr << "  -V : video mode, raw frames of this size and ffmpeg pixel format from stdin to stdout, e.g. 1920x1080:gray (also gray16le/rgb24/rgb48le)" << std::endl;
+		std::cerr << "  -E : video mode, weight of each new frame's CDF in the moving average, 1 = no smoothing (default: 1)" << std::endl;
+		std::cerr << "  -K : video mode, histogram every k-th frame only and reuse the smoothed LUT in between (default: 1)" << std::endl;
+		std::cerr << "  -M : split the image across several devices, all or a list of platform:device pairs (e.g. 0:0,1:0) instead of -p/-d" << std::endl;
+		std::cerr << "  -S : service mode, keep everything warm and take requests on this unix socket path (see EqualisationService.h)" << std::endl;
+		std::cerr << "  -F : build the kernels for this image's size only (default: size passed at run time)" << std::endl;
+		std::cerr << "  -B : run the benchmarks (atomic contention on synthetic images, scan correctness/timing) instead of -i" << std::endl;
 		std::cerr << "  -h : print this message" << std::endl;
 	}
 
@@ -0,0 +1,212 @@
+#pragma once
+#include "ImageProcessor.h"
+#include <cstdio>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+//video mode (-V) -- equalises a raw video stream, fixed size frames read from stdin and written to stdout, e.g.
+//  ffmpeg -i in.mp4 -f rawvideo -pix_fmt gray - | app -V 1920x1080:gray | ffmpeg -f rawvideo -pix_fmt gray -s 1920x1080 -i - out.mp4
+//the program, kernels and buffers are set up once for the whole stream, and two frame slots are alternated so the host reads the next
+//frame and writes out the previous one while the device works on the current one
+//-E blends each frame's CDF into an exponential moving average of the frames before it, so the LUT cannot jump from frame to frame
+//(flicker) -- and since the smoothed LUT only moves slowly, -K can histogram every k-th frame only and let the others reuse it
+//the CDFs are blended on the host, so a histogrammed frame reads its histograms (bins * channels counters) back mid pipeline
+//stdout carries the frames, everything else is printed to stderr (see main)
+
+//frame size and ffmpeg pixel format, "<width>x<height>:<gray|gray16le|rgb24|rgb48le>"
+//16 bit samples are taken as they are, little-endian like the devices and hosts this runs on
+struct VideoFormat
+{
+	int width = 0;
+	int height = 0;
+	int channels = 1; //interleaved, as ffmpeg writes them
+	int bytesPerSample = 1;
+
+	static bool Parse(const std::string& text, VideoFormat& format) {
+		char pixelFormat[16] = {};
+		if (std::sscanf(text.c_str(), "%dx%d:%15s", &format.width, &format.height, pixelFormat) != 3) return false;
+		if (format.width <= 0 || format.height <= 0) return false;
+		std::string name = pixelFormat;
+		if      (name == "gray")     { format.channels = 1; format.bytesPerSample = 1; }
+		else if (name == "gray16le") { format.channels = 1; format.bytesPerSample = 2; }
+		else if (name == "rgb24")    { format.channels = 3; format.bytesPerSample = 1; }
+		else if (name == "rgb48le")  { format.channels = 3; format.bytesPerSample = 2; }
+		else return false;
+		return true;
+	}
+	size_t FrameSamples() const { return (size_t)width * height * channels; }
+};
+
+template<typename CIMG_TYPE>
+class VideoStreamProcessor
+{
+public:
+	//alpha is the new frame's weight in the CDF average (1 = no smoothing), every is how often a frame is histogrammed
+	VideoStreamProcessor(int platform_id, int device_id, int _workgroup_size, int _num_bins, const VideoFormat& _format, std::string& kernel_folder, bool ignoreColour, double _alpha, int _every)
+		:workgroup_size(_workgroup_size),
+		num_bins(_num_bins),
+		format(_format),
+		alpha(std::min(std::max(_alpha, 0.0), 1.0)),
+		every(std::max(_every, 1))
+	{
+		//pooled colour is one channel whatever the layout, otherwise the channels are kept apart by stride
+		channels = ignoreColour ? 1 : format.channels;
+		frameSamples = format.FrameSamples();
+		channelSize = frameSamples / channels;
+		//each histogram counts one channel, the program's HIST_TYPE below follows the same size so host and kernels agree on the layout
+		hist_size = HistTypeSize(channelSize);
+
+		context = Utils::GetContext(platform_id, device_id);
+		Utils::AddAllSources(sources, kernel_folder);
+		queue = cl::CommandQueue(context);
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		local = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() >= sizeof(LOCAL_HIST_TYPE) * num_bins;
+		if (!local) return;
+		cl::Program program = BuildProgram(context, sources, GetBuildOptions<CIMG_TYPE>(num_bins, 16 / sizeof(CIMG_TYPE), channelSize));
+
+		histograms = cl::Buffer(context, CL_MEM_READ_WRITE, channels * num_bins * hist_size);
+		luts = cl::Buffer(context, CL_MEM_READ_ONLY, channels * num_bins * hist_size);
+		for (Slot& slot : slots) {
+			slot.frame = cl::Buffer(context, CL_MEM_READ_WRITE, frameSamples * sizeof(CIMG_TYPE));
+			slot.host.resize(frameSamples);
+		}
+		partial.resize(channels * num_bins * hist_size);
+		lutHost.resize(channels * num_bins * hist_size);
+		cdf.resize(channels * num_bins);
+
+		//the colour kernels with interleaved strides (see Colour.cl), the frame argument is set per slot
+		cl_ulong channelStride = channels > 1 ? 1 : channelSize;
+		cl_ulong pixelStride = channels > 1 ? channels : 1;
+		histogramKernel = cl::Kernel(program, "createHistogram_Colour");
+		histogramKernel.setArg(1, histograms);
+		histogramKernel.setArg(2, cl::Local(sizeof(LOCAL_HIST_TYPE) * num_bins));
+		histogramKernel.setArg(3, (cl_ulong)channelSize);
+		histogramKernel.setArg(4, channelStride);
+		histogramKernel.setArg(5, pixelStride);
+		lookupKernel = cl::Kernel(program, "ApplyHistogram_Colour");
+		lookupKernel.setArg(1, luts);
+		lookupKernel.setArg(2, (cl_ulong)channelSize);
+		lookupKernel.setArg(3, channelStride);
+		lookupKernel.setArg(4, pixelStride);
+	}
+	virtual ~VideoStreamProcessor() {}
+public:
+	void Run() {
+		if (!local) {
+			std::cout << "Video mode (-V) keeps the histogram in local memory, " << num_bins << " bins do not fit" << std::endl;
+			return;
+		}
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		size_t globalSize = ((channelSize + workgroup_size - 1) / workgroup_size) * workgroup_size;
+		size_t frames = 0;
+		size_t histogrammed = 0;
+		Slot* previous = nullptr;
+		std::chrono::time_point start = std::chrono::high_resolution_clock::now();
+		while (true) {
+			//this slot's last frame was written out during the previous iteration
+			Slot& slot = slots[frames % slotCount];
+			if (!ReadFrame(slot)) break;
+			bool histogram = frames % every == 0;
+			std::vector<cl::Event> chain(1);
+			queue.enqueueWriteBuffer(slot.frame, CL_FALSE, 0, frameSamples * sizeof(CIMG_TYPE), slot.host.data(), nullptr, &chain[0]);
+			cl::Event histogramRead;
+			if (histogram) {
+				queue.enqueueFillBuffer<cl_uint>(histograms, 0, 0, channels * num_bins * hist_size, &chain, &chain[0]);
+				histogramKernel.setArg(0, slot.frame);
+				queue.enqueueNDRangeKernel(histogramKernel, cl::NullRange, cl::NDRange(globalSize, channels), cl::NDRange(workgroup_size, 1), &chain, &chain[0]);
+				queue.enqueueReadBuffer(histograms, CL_FALSE, 0, partial.size(), partial.data(), &chain, &histogramRead);
+			}
+			queue.flush();
+			//the previous frame's apply and read back have been running while this frame was read in, and the histogram runs while it is written out
+			if (previous != nullptr) WriteFrame(*previous);
+			if (histogram) {
+				histogramRead.wait();
+				UpdateLuts();
+				histogrammed++;
+				//lutHost is only changed again after the next histogram read, which the in order queue runs after this write
+				queue.enqueueWriteBuffer(luts, CL_FALSE, 0, lutHost.size(), lutHost.data(), &chain, &chain[0]);
+			}
+			lookupKernel.setArg(0, slot.frame);
+			queue.enqueueNDRangeKernel(lookupKernel, cl::NullRange, cl::NDRange(globalSize, channels), cl::NDRange(workgroup_size, 1), &chain, &chain[0]);
+			queue.enqueueReadBuffer(slot.frame, CL_FALSE, 0, frameSamples * sizeof(CIMG_TYPE), slot.host.data(), &chain, &slot.done);
+			queue.flush();
+			previous = &slot;
+			frames++;
+		}
+		if (previous != nullptr) WriteFrame(*previous);
+		std::chrono::time_point end = std::chrono::high_resolution_clock::now();
+		double seconds = std::chrono::duration<double>(end - start).count();
+		std::cout
+			<< "Video: " << frames << " frames of " << format.width << "x" << format.height << ", " << histogrammed << " histogrammed\n"
+			<< "Frames per second: " << (seconds > 0 ? frames / seconds : 0.0)
+			<< std::endl;
+	}
+protected:
+	struct Slot {
+		cl::Buffer frame;
+		std::vector<CIMG_TYPE> host;
+		cl::Event done;
+	};
+	//one frame being read or written on the host while the other is on the device
+	static const int slotCount = 2;
+
+	bool ReadFrame(Slot& slot) {
+		size_t read = std::fread(slot.host.data(), sizeof(CIMG_TYPE), frameSamples, stdin);
+		if (read != 0 && read != frameSamples) std::cout << "Dropped a partial frame at the end of the stream (" << read << " of " << frameSamples << " samples)" << std::endl;
+		return read == frameSamples;
+	}
+	void WriteFrame(Slot& slot) {
+		slot.done.wait();
+		std::fwrite(slot.host.data(), sizeof(CIMG_TYPE), frameSamples, stdout);
+		std::fflush(stdout); //the next stage sees each frame as soon as it is done (live streams)
+	}
+
+	//each channel's CDF is normalised to [0, 1] and blended into the running average, which the LUT is then made from
+	//with the same arithmetic as NormalizeHistogram_Colour (the apply kernel clamps to the top level)
+	void UpdateLuts() {
+		const double levels = (double)(1ull << (sizeof(CIMG_TYPE) * 8));
+		for (int col = 0; col < channels; col++) {
+			std::vector<unsigned long long> histogram(num_bins, 0);
+			std::vector<unsigned char> channelPartial(partial.begin() + col * num_bins * hist_size, partial.begin() + (col + 1) * num_bins * hist_size);
+			AddPartialHistogram(histogram, channelPartial, hist_size);
+			for (int bin = 1; bin < num_bins; bin++) histogram[bin] += histogram[bin - 1];
+			double total = (double)std::max<unsigned long long>(histogram.back(), 1);
+			for (int bin = 0; bin < num_bins; bin++) {
+				size_t index = col * num_bins + bin;
+				double frameCdf = histogram[bin] / total;
+				cdf[index] = haveCdf ? alpha * frameCdf + (1.0 - alpha) * cdf[index] : frameCdf;
+				unsigned long long value = (unsigned long long)(cdf[index] * levels);
+				if (hist_size == sizeof(ulong)) ((ulong*)lutHost.data())[index] = value;
+				else                            ((uint*)lutHost.data())[index] = (uint)value;
+			}
+		}
+		haveCdf = true;
+	}
+
+	int workgroup_size;
+	int num_bins;
+	VideoFormat format;
+	double alpha;
+	int every;
+	int channels;
+	size_t frameSamples;
+	size_t channelSize;
+	size_t hist_size;
+	bool local;
+	cl::Program::Sources sources;
+	cl::Context context;
+	cl::CommandQueue queue;
+	cl::Kernel histogramKernel;
+	cl::Kernel lookupKernel;
+	cl::Buffer histograms;
+	cl::Buffer luts;
+	Slot slots[slotCount];
+	std::vector<unsigned char> partial; //the last histograms read back
+	std::vector<unsigned char> lutHost; //HIST_TYPE, like the normalised histograms the apply kernel usually reads
+	std::vector<double> cdf;            //running average, channel by channel
+	bool haveCdf = false;
+};
@@ -0,0 +1,81 @@
+//colour-fused versions of each step - every channel is handled by one launch using a 2-D range of (pixel or bin, channel)
+//histograms are stored back to back, channel c's bins start at c * NUM_BINS
+//channelSize is the number of pixels in one channel
+//sample (pixel, channel) is at channel * channelStride + pixel * pixelStride, so one kernel reads either layout in place:
+//planar like CImg (channelStride = channelSize, pixelStride = 1) or interleaved like PPM files (channelStride = 1, pixelStride = channels)
+
+kernel void createHistogram_Colour(global DATA_TYPE* A, global HIST_TYPE* Histograms, local LOCAL_HIST_TYPE* LocalHistogram, ulong channelSize, ulong channelStride, ulong pixelStride) {
+	int lid = get_local_id(0);
+	size_t pixel = get_global_id(0);
+	size_t channel = get_global_id(1); //local size is 1 in dimension 1 so a group never mixes channels
+	for (int i = lid; i < NUM_BINS; i += get_local_size(0))
+	{
+		LocalHistogram[i] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (pixel < channelSize) {
+		uint bin = ((uint)A[channel * channelStride + pixel * pixelStride] * NUM_BINS) / (1 << BIT_DEPTH);
+		atomic_inc(&LocalHistogram[bin]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	global HIST_TYPE* Histogram = Histograms + channel * NUM_BINS;
+	for (int i = lid; i < NUM_BINS; i += get_local_size(0))
+	{
+		if (LocalHistogram[i] != 0)
+			atom_add(&Histogram[i], (HIST_TYPE)LocalHistogram[i]);
+	}
+}
+
+//one workgroup per channel (dimension 1) scans its histogram in place, local_size bins at a time
+//each chunk is scanned in local memory (Hillis-Steele, as in AccumulateHistogram_1) and offset by the running total of the chunks before it
+kernel void AccumulateHistogram_Colour(global HIST_TYPE* Histograms, local HIST_TYPE* localA, local HIST_TYPE* localB) {
+	int lid = get_local_id(0);
+	int localSize = get_local_size(0);
+	global HIST_TYPE* Histogram = Histograms + get_group_id(1) * NUM_BINS;
+	HIST_TYPE carry = 0;
+	for (int chunk = 0; chunk < NUM_BINS; chunk += localSize) {
+		int bin = chunk + lid;
+		local HIST_TYPE* In = localA;
+		local HIST_TYPE* Out = localB;
+		local HIST_TYPE* Swap;
+		In[lid] = (bin < NUM_BINS) ? Histogram[bin] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (int i = 1; i < localSize; i *= 2) {
+			Out[lid] = In[lid];
+			if (lid >= i)
+				Out[lid] += In[lid - i];
+			barrier(CLK_LOCAL_MEM_FENCE);
+			Swap = In;
+			In = Out;
+			Out = Swap;
+		}
+		if (bin < NUM_BINS)
+			Histogram[bin] = In[lid] + carry;
+		carry += In[localSize - 1];
+		barrier(CLK_LOCAL_MEM_FENCE); //everyone has read the chunk total before the next chunk overwrites it
+	}
+}
+
+//written to a separate buffer -- the groups of a channel all read its total from the last bin, which must not change under them
+kernel void NormalizeHistogram_Colour(global const HIST_TYPE* Histograms, global HIST_TYPE* Normal) {
+	int bin = get_global_id(0);
+	if (bin < NUM_BINS) {
+		size_t channel = get_global_id(1) * NUM_BINS;
+		HIST_TYPE max_val = Histograms[channel + NUM_BINS - 1];
+		Normal[channel + bin] = ((ulong)Histograms[channel + bin] * (1 << BIT_DEPTH)) / max_val;
+	}
+}
+
+kernel void ApplyHistogram_Colour(global DATA_TYPE* A, global HIST_TYPE* Histograms, ulong channelSize, ulong channelStride, ulong pixelStride) {
+	size_t pixel = get_global_id(0);
+	size_t channel = get_global_id(1);
+	if (pixel < channelSize) {
+		size_t index = channel * channelStride + pixel * pixelStride;
+		uint bin = ((uint)A[index] * NUM_BINS) / (1 << BIT_DEPTH);
+		const HIST_TYPE MaxVal = (1 << BIT_DEPTH) - 1;//clamp to prevent overflow
+		A[index] = min(Histograms[channel * NUM_BINS + bin], MaxVal);
+	}
+}
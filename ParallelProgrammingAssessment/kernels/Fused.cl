@@ -0,0 +1,70 @@
+//fused histogram -> cumulative histogram -> LUT, so each channel only needs this launch and ApplyHistogram
+//the histogram part is createHistogram_GridStride, flushed into Counts. each group then takes a ticket, and the last group to
+//finish (so the only one that can see the complete histogram) scans and normalises it in local memory and writes the LUT
+//the last group also hands Counts back zeroed and resets Ticket, so the next channel / run needs no clearing
+kernel void createHistogram_Fused(global DATA_TYPE* A, global HIST_TYPE* Counts, global HIST_TYPE* Lut, global uint* Ticket,
+	local LOCAL_HIST_TYPE* LocalHistogram, local HIST_TYPE* Cdf, local HIST_TYPE* localA, local HIST_TYPE* localB, ulong count) {
+	local uint isLast;
+	int lid = get_local_id(0);
+	int localSize = get_local_size(0);
+	size_t end = get_global_offset(0) + PIXEL_COUNT(count);
+	for (int i = lid; i < NUM_BINS; i += localSize)
+	{
+		LocalHistogram[i] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (size_t gid = get_global_id(0); gid < end; gid += get_global_size(0)) {
+		uint bin = ((uint)A[gid] * NUM_BINS) / (1 << BIT_DEPTH);
+		atomic_inc(&LocalHistogram[bin]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < NUM_BINS; i += localSize)
+	{
+		if (LocalHistogram[i] != 0)
+			atom_add(&Counts[i], (HIST_TYPE)LocalHistogram[i]);
+	}
+
+	//the whole flush has to be visible to other groups before this group counts itself as done
+	mem_fence(CLK_GLOBAL_MEM_FENCE);
+	barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+	if (lid == 0)
+		isLast = atomic_inc(Ticket) == get_num_groups(0) - 1;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (!isLast) return; //same value for the whole group so the barriers below are still reached by everyone who is left
+
+	//scan in chunks of local_size bins as in AccumulateHistogram_Colour, into Cdf instead of back into global
+	HIST_TYPE carry = 0;
+	for (int chunk = 0; chunk < NUM_BINS; chunk += localSize) {
+		int bin = chunk + lid;
+		local HIST_TYPE* In = localA;
+		local HIST_TYPE* Out = localB;
+		local HIST_TYPE* Swap;
+		//atomic read so no stale value from before the other groups' flushes is seen, and clear for the next launch
+		In[lid] = (bin < NUM_BINS) ? atom_xchg(&Counts[bin], 0) : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (int i = 1; i < localSize; i *= 2) {
+			Out[lid] = In[lid];
+			if (lid >= i)
+				Out[lid] += In[lid - i];
+			barrier(CLK_LOCAL_MEM_FENCE);
+			Swap = In;
+			In = Out;
+			Out = Swap;
+		}
+		if (bin < NUM_BINS)
+			Cdf[bin] = In[lid] + carry;
+		carry += In[localSize - 1];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	//carry is now the total pixel count, i.e. the last bin of the cumulative histogram
+	for (int i = lid; i < NUM_BINS; i += localSize)
+	{
+		Lut[i] = ((ulong)Cdf[i] * (1 << BIT_DEPTH)) / carry; //same as NormalizeHistogram
+	}
+	if (lid == 0)
+		*Ticket = 0;
+}
@@ -1,8 +1,10 @@
-kernel void createHistogram_Global(global DATA_TYPE* A, global HIST_TYPE* GlobalHistogram) {
-	int gid = get_global_id(0);
+//PIXEL_COUNT(count) is the channel's pixel count for the per-pixel kernels of every file, defined by the build options (see GetBuildOptions)
+
+kernel void createHistogram_Global(global DATA_TYPE* A, global HIST_TYPE* GlobalHistogram, ulong offset, ulong count) {
+	size_t gid = get_global_id(0);
 
-	if (gid < IMAGE_SIZE) {
-		HIST_TYPE bin = (A[gid] * NUM_BINS) / (1 << BIT_DEPTH); //if the number of bins is not equivalent to the bit depth's value range, rescale the value
+	if (gid < PIXEL_COUNT(count)) {
+		HIST_TYPE bin = ((uint)A[offset + gid] * NUM_BINS) / (1 << BIT_DEPTH); //if the number of bins is not equivalent to the bit depth's value range, rescale the value
 		atom_inc(&GlobalHistogram[bin]);
 	}
 }
@@ -45,18 +47,79 @@ kernel void AccumulateHistogram_SingleGroup(global HIST_TYPE* A, global HIST_TYP
 	}
 }
 
+//work-efficient (Blelloch) version of the above - O(n) adds in an up-sweep and a down-sweep instead of O(n log n)
+//still a single group, but it stages the histogram through local memory 2 * local size bins at a time
+//so there are no global barriers, and the carry from each chunk is added to the next. local size must be a power of 2
+//the scan is done in place (A becomes its inclusive scan). count is the number of elements, NUM_BINS for a histogram
+kernel void AccumulateHistogram_Blelloch(global HIST_TYPE* A, local HIST_TYPE* temp, uint count) {
+	int lid = get_local_id(0);
+	int n = get_local_size(0) * 2;
+	int ai = lid;
+	int bi = lid + n / 2;
+	HIST_TYPE carry = 0;
+	for (int chunk = 0; chunk < count; chunk += n) {
+		HIST_TYPE a = (chunk + ai < count) ? A[chunk + ai] : 0;
+		HIST_TYPE b = (chunk + bi < count) ? A[chunk + bi] : 0;
+		temp[ai] = a;
+		temp[bi] = b;
+
+		//up-sweep (reduce) - builds partial sums in a balanced tree
+		int offset = 1;
+		for (int d = n >> 1; d > 0; d >>= 1) {
+			barrier(CLK_LOCAL_MEM_FENCE);
+			if (lid < d) {
+				int x = offset * (2 * lid + 1) - 1;
+				int y = offset * (2 * lid + 2) - 1;
+				temp[y] += temp[x];
+			}
+			offset <<= 1;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		HIST_TYPE total = temp[n - 1];
+		barrier(CLK_LOCAL_MEM_FENCE); //everyone has the chunk total before the root is cleared
+		if (lid == 0) temp[n - 1] = 0;
+
+		//down-sweep - walks back down the tree turning the partial sums into an exclusive scan
+		for (int d = 1; d < n; d <<= 1) {
+			offset >>= 1;
+			barrier(CLK_LOCAL_MEM_FENCE);
+			if (lid < d) {
+				int x = offset * (2 * lid + 1) - 1;
+				int y = offset * (2 * lid + 2) - 1;
+				HIST_TYPE t = temp[x];
+				temp[x] = temp[y];
+				temp[y] += t;
+			}
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		//adding each bin's own value back gives the inclusive scan
+		if (chunk + ai < count) A[chunk + ai] = temp[ai] + a + carry;
+		if (chunk + bi < count) A[chunk + bi] = temp[bi] + b + carry;
+		carry += total;
+		barrier(CLK_LOCAL_MEM_FENCE); //finish reading temp before the next chunk overwrites it
+	}
+}
+
+//big-endian 16 bit samples (mapped PGM/PPM files, see MappedPnm.h) to the device's order and back, in place over the whole image
+kernel void ByteSwap16(global ushort* A, ulong count) {
+	size_t gid = get_global_id(0);
+	if (gid < count) A[gid] = rotate(A[gid], (ushort)8);
+}
+
 kernel void NormalizeHistogram_Global(global HIST_TYPE* A) {
 	int gid = get_global_id(0);
 	if (gid < NUM_BINS) {
 		HIST_TYPE max_val = A[NUM_BINS - 1];
-		A[gid] = (A[gid] * (1 << BIT_DEPTH)) / max_val;
+		A[gid] = ((ulong)A[gid] * (1 << BIT_DEPTH)) / max_val; //widened so 32 bit histograms can not overflow
 	}
 	
 }
-kernel void ApplyHistogram_Global(global DATA_TYPE* A, global HIST_TYPE* Hist) {
-	int gid = get_global_id(0);
-	if (gid < IMAGE_SIZE) {
-		HIST_TYPE bin = (A[gid] * NUM_BINS) / (1 << BIT_DEPTH); //if the number of bins is not equivalent to the bit depth's value range, rescale the value
+kernel void ApplyHistogram_Global(global DATA_TYPE* A, global HIST_TYPE* Hist, ulong offset, ulong count) {
+	size_t gid = get_global_id(0);
+	if (gid < PIXEL_COUNT(count)) {
+		gid += offset;
+		HIST_TYPE bin = ((uint)A[gid] * NUM_BINS) / (1 << BIT_DEPTH); //if the number of bins is not equivalent to the bit depth's value range, rescale the value
 		const HIST_TYPE MaxVal = (1 << BIT_DEPTH) - 1;//clamp to prevent overflow
 		A[gid] = min(Hist[bin], MaxVal);
 	}
@@ -1,61 +1,157 @@
-kernel void createHistogram(global DATA_TYPE* A, global HIST_TYPE* GlobalHistogram, local HIST_TYPE* LocalHistogram) {
+kernel void createHistogram(global DATA_TYPE* A, global HIST_TYPE* GlobalHistogram, local LOCAL_HIST_TYPE* LocalHistogram, ulong offset, ulong count) {
 	int lid = get_local_id(0);
-	int gid = get_global_id(0);
-	if (gid < IMAGE_SIZE) {
-		//if there are less threads than bins, we need to use a stride to get them all
-		for (int i = lid; i < NUM_BINS; i += get_local_size(0))
-		{
-			//clear local histogram
-			LocalHistogram[i] = 0;
-		}
-		barrier(CLK_LOCAL_MEM_FENCE); //sync so that whole local histogram is cleared
+	size_t gid = get_global_id(0);
+	//if there are less threads than bins, we need to use a stride to get them all
+	for (int i = lid; i < NUM_BINS; i += get_local_size(0))
+	{
+		//clear local histogram
+		LocalHistogram[i] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE); //sync so that whole local histogram is cleared
 
-		//atomically create local histogram
+	//atomically create local histogram
+	//only the bounds check is conditional so the padding work-items of the last group still reach every barrier
+	if (gid < PIXEL_COUNT(count)) {
+		HIST_TYPE bin = ((uint)A[offset + gid] * NUM_BINS) / (1 << BIT_DEPTH); //if the number of bins is not equivalent to the bit depth's value range, rescale the value
+		atomic_inc(&LocalHistogram[bin]);
+	}
 
-		HIST_TYPE bin = (A[gid] * NUM_BINS) / (1 << BIT_DEPTH); //if the number of bins is not equivalent to the bit depth's value range, rescale the value
-		atom_inc(&LocalHistogram[bin]);
+	barrier(CLK_LOCAL_MEM_FENCE); //sync for local histogram to complete
 
-		barrier(CLK_LOCAL_MEM_FENCE); //sync for local histogram to complete
+	for (int i = lid; i < NUM_BINS; i += get_local_size(0))
+	{
+		//atomically add local histogram to global
+		atom_add(&GlobalHistogram[i], (HIST_TYPE)LocalHistogram[i]); //one wide atomic per bin per group
+	}
+	//no need to sync if we return to host here
+	//barrier(CLK_GLOBAL_MEM_FENCE); //sync after creating global histogram
+}
 
-		for (int i = lid; i < NUM_BINS; i += get_local_size(0))
-		{
-			//atomically add local histogram to global
-			atom_add(&GlobalHistogram[i], LocalHistogram[i]);
-		}
-		//no need to sync if we return to host here
-		//barrier(CLK_GLOBAL_MEM_FENCE); //sync after creating global histogram
+//persistent version of createHistogram - launched with a fixed number of groups that stride over the whole channel
+//each group only clears and flushes its local histogram once, however many pixels it visits
+//count is the number of pixels in the channel, since the global size no longer matches the image
+kernel void createHistogram_GridStride(global DATA_TYPE* A, global HIST_TYPE* GlobalHistogram, local LOCAL_HIST_TYPE* LocalHistogram, ulong count) {
+	int lid = get_local_id(0);
+	size_t end = get_global_offset(0) + PIXEL_COUNT(count);
+	for (int i = lid; i < NUM_BINS; i += get_local_size(0))
+	{
+		//clear local histogram
+		LocalHistogram[i] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE); //sync so that whole local histogram is cleared
+
+	//consecutive work-items read consecutive pixels on every pass so the loads stay coalesced
+	for (size_t gid = get_global_id(0); gid < end; gid += get_global_size(0)) {
+		HIST_TYPE bin = ((uint)A[gid] * NUM_BINS) / (1 << BIT_DEPTH); //if the number of bins is not equivalent to the bit depth's value range, rescale the value
+		atomic_inc(&LocalHistogram[bin]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE); //sync for local histogram to complete
+
+	for (int i = lid; i < NUM_BINS; i += get_local_size(0))
+	{
+		//empty bins are common with many bins per group, skipping them saves a global atomic each
+		if (LocalHistogram[i] != 0)
+			atom_add(&GlobalHistogram[i], (HIST_TYPE)LocalHistogram[i]);
+	}
+}
+
+//version of createHistogram for low-entropy images (black borders, white paper etc)
+//work-items are spread over R replicated copies of the local histogram (copy = lid % R) so that a single dominant value
+//is split across R counters instead of serialising the whole group on one atomic. the copies are merged before the global flush
+kernel void createHistogram_Replicated(global DATA_TYPE* A, global HIST_TYPE* GlobalHistogram, local LOCAL_HIST_TYPE* LocalHistograms, uint replicas, ulong offset, ulong count) {
+	int lid = get_local_id(0);
+	size_t gid = get_global_id(0);
+	for (int i = lid; i < NUM_BINS * replicas; i += get_local_size(0))
+	{
+		//clear all copies
+		LocalHistograms[i] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (gid < PIXEL_COUNT(count)) {
+		HIST_TYPE bin = ((uint)A[offset + gid] * NUM_BINS) / (1 << BIT_DEPTH); //if the number of bins is not equivalent to the bit depth's value range, rescale the value
+		atomic_inc(&LocalHistograms[(lid % replicas) * NUM_BINS + bin]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE); //sync for all copies to complete
+
+	for (int i = lid; i < NUM_BINS; i += get_local_size(0))
+	{
+		//merge the copies then flush once per bin
+		HIST_TYPE total = 0;
+		for (uint r = 0; r < replicas; r++)
+			total += LocalHistograms[r * NUM_BINS + i];
+		if (total != 0)
+			atom_add(&GlobalHistogram[i], total);
+	}
+}
+
+//bin-partitioned histogram for bin counts whose histogram does not fit in local memory (e.g. 65536 bins for full range 16 bit)
+//dimension 1 selects a slice of sliceBins consecutive bins - each group keeps only its slice in local memory and skips pixels outside it
+//dimension 0 is a grid-stride loop over the channel like createHistogram_GridStride
+kernel void createHistogram_Partitioned(global DATA_TYPE* A, global HIST_TYPE* GlobalHistogram, local LOCAL_HIST_TYPE* LocalHistogram, uint sliceBins, ulong count) {
+	int lid = get_local_id(0);
+	uint first = get_global_id(1) * sliceBins; //local size is 1 in dimension 1 so this is the slice index
+	size_t end = get_global_offset(0) + PIXEL_COUNT(count);
+	for (uint i = lid; i < sliceBins; i += get_local_size(0))
+	{
+		LocalHistogram[i] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (size_t gid = get_global_id(0); gid < end; gid += get_global_size(0)) {
+		uint bin = ((uint)A[gid] * NUM_BINS) / (1 << BIT_DEPTH);
+		uint slot = bin - first; //wraps around to a huge value for bins below the slice, so one compare covers both ends
+		if (slot < sliceBins)
+			atomic_inc(&LocalHistogram[slot]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint i = lid; i < sliceBins; i += get_local_size(0))
+	{
+		if (first + i < NUM_BINS && LocalHistogram[i] != 0)
+			atom_add(&GlobalHistogram[first + i], (HIST_TYPE)LocalHistogram[i]);
 	}
 }
 
-//accumulation is done through scanning - the intermediate scan of block sums is implied in the second step
-//(instead of explicitly scanning block sums, the input is just used directly later on)
-kernel void AccumulateHistogram_1(global HIST_TYPE* A, global HIST_TYPE* B, local HIST_TYPE* localA,local HIST_TYPE* localB) {
+//accumulation is done through scanning, in three phases:
+//1 - each block (workgroup) scans its own bins and writes its total to BlockSums
+//2 - BlockSums is scanned (AccumulateHistogram_Blelloch in Global.cl, run as a single group)
+//3 - every bin gets the total of all the blocks before it added (uniform add)
+kernel void AccumulateHistogram_1(global HIST_TYPE* A, global HIST_TYPE* B, local HIST_TYPE* localA,local HIST_TYPE* localB, global HIST_TYPE* BlockSums) {
 	// 1 - accumulate block (size determined by workgroup size)
 	int lid = get_local_id(0);
 	int gid = get_global_id(0);
 	int block = get_group_id(0);
-	if (gid < NUM_BINS) {
 
+	//pad the last block with 0s so every work-item reaches every barrier
+	localA[lid] = (gid < NUM_BINS) ? A[gid] : 0; //initial copy
+	barrier(CLK_LOCAL_MEM_FENCE);
+	local HIST_TYPE* localC;
+	for (int i = 1; i < get_local_size(0); i *= 2) {
 
-		localA[lid] = A[gid]; //initial copy
-		local HIST_TYPE* localC;
-		for (int i = 1; i < get_local_size(0); i *= 2) {
+		localB[lid] = localA[lid];
+		if (lid >= i)
+			localB[lid] += localA[lid - i];
+		barrier(CLK_LOCAL_MEM_FENCE);
+		localC = localA;
+		localA = localB;
+		localB = localC;
 
-			localB[lid] = localA[lid];
-			if (lid >= i)
-				localB[lid] += localA[lid - i];
-			barrier(CLK_LOCAL_MEM_FENCE);
-			localC = localA;
-			localA = localB;
-			localB = localC;
-
-		}
+	}
 
-		barrier(CLK_GLOBAL_MEM_FENCE);
-		//localA is now the output for current block
+	//localA is now the output for current block
+	if (gid < NUM_BINS)
 		B[gid] = localA[lid];
-	}
+	//the last work-item holds the block total
+	if (lid == get_local_size(0) - 1)
+		BlockSums[block] = localA[lid];
 }
+//original second step - the scan of block sums is implied by every bin re-reading all the previous block totals
+//that is O(bins * blocks) global reads, so it has been replaced by AccumulateHistogram_Blelloch + AccumulateHistogram_3
+//kept so the scan benchmark (-B) can compare against it
 kernel void AccumulateHistogram_2(global HIST_TYPE* A, global HIST_TYPE* B) {
 	//read from input add to output (map / maybe gather pattern) - no races
 	//add the max of each previous block to each value in output
@@ -72,24 +168,159 @@ kernel void AccumulateHistogram_2(global HIST_TYPE* A, global HIST_TYPE* B) {
 		}
 	}
 }
+kernel void AccumulateHistogram_3(global HIST_TYPE* A, global HIST_TYPE* BlockSums, global HIST_TYPE* B) {
+	// 3 - uniform add, BlockSums has been scanned so BlockSums[block - 1] is the total of every earlier block
+	int gid = get_global_id(0);
+	int block = get_group_id(0);
+	if (gid < NUM_BINS) {
+		B[gid] = A[gid] + (block > 0 ? BlockSums[block - 1] : 0);
+	}
+}
+//single pass alternative to the three phases above (decoupled look-back)
+//Status[0] is a ticket counter and Status[1 + block] holds (value << 2) | flag for each block, written with a single atomic so value and flag can not tear
+//blocks take their index from the ticket, so a block only ever waits on blocks that are already running - this still needs the device
+//to keep running groups that have started (see ForwardProgressProbe), the host falls back to the three phase scan when it does not
+//the status words need 64 bit atomics, which are optional -- both kernels are left out of the program on devices without them,
+//so the rest of the program still builds there (the host checks the extension before creating either, see SupportsLookBackScan)
+#ifdef cl_khr_int64_base_atomics
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+#define LOOKBACK_AGGREGATE 1 //block total is known
+#define LOOKBACK_PREFIX 2 //total of this block and every block before it is known
+kernel void AccumulateHistogram_LookBack(global HIST_TYPE* A, local HIST_TYPE* localA, local HIST_TYPE* localB, global ulong* Status) {
+	local uint block;
+	local HIST_TYPE exclusive;
+	int lid = get_local_id(0);
+	if (lid == 0)
+		block = atom_inc(&Status[0]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	int gid = block * get_local_size(0) + lid;
+	global ulong* Flags = Status + 1;
+
+	//block scan, same as AccumulateHistogram_1
+	localA[lid] = (gid < NUM_BINS) ? A[gid] : 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	local HIST_TYPE* localC;
+	for (int i = 1; i < get_local_size(0); i *= 2) {
+		localB[lid] = localA[lid];
+		if (lid >= i)
+			localB[lid] += localA[lid - i];
+		barrier(CLK_LOCAL_MEM_FENCE);
+		localC = localA;
+		localA = localB;
+		localB = localC;
+	}
+
+	//the last work-item holds the block total - publish it, then walk back over earlier blocks until one has its full prefix
+	if (lid == get_local_size(0) - 1) {
+		ulong aggregate = localA[lid];
+		ulong sum = 0;
+		if (block > 0) {
+			atom_xchg(&Flags[block], (aggregate << 2) | LOOKBACK_AGGREGATE);
+			int b = block - 1;
+			for (;;) {
+				ulong status = atom_add(&Flags[b], 0); //atomic read so the spin always sees the latest value
+				if ((status & 3) == 0) continue; //not published yet
+				sum += status >> 2;
+				if (status & LOOKBACK_PREFIX) break;
+				b--;
+			}
+		}
+		atom_xchg(&Flags[block], ((sum + aggregate) << 2) | LOOKBACK_PREFIX);
+		exclusive = sum;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	//each block only reads its own bins before this, so the result can go straight back into A
+	if (gid < NUM_BINS)
+		A[gid] = localA[lid] + exclusive;
+}
+
+//startup check for AccumulateHistogram_LookBack - every group waits on the group with the previous ticket, exactly like the look-back
+//a device that can starve a running group of the ones it waits on hits the spin limit and sets Failed instead of hanging
+kernel void ForwardProgressProbe(global ulong* Flags, global uint* Failed, uint spinLimit) {
+	if (get_local_id(0) != 0) return;
+	uint ticket = atom_inc(&Flags[0]);
+	if (ticket > 0) {
+		uint spins = 0;
+		while (atom_add(&Flags[ticket], 0) == 0) {
+			//give up at the limit, or straight away once another group has - otherwise a failing chain of groups would each wait out the limit
+			if (++spins == spinLimit || atomic_add(Failed, 0) != 0) {
+				atomic_xchg(Failed, 1);
+				break;
+			}
+		}
+	}
+	atom_xchg(&Flags[ticket + 1], 1);
+}
+#endif
 //This is entirely identical to NormalizeHistogram_Global
 //There is no need for local memory to be used since each output bin is set once (map pattern) - no race condition can occur
 kernel void NormalizeHistogram(global HIST_TYPE* A) {
 	int gid = get_global_id(0);
 	if (gid < NUM_BINS){
 		HIST_TYPE max_val = A[NUM_BINS - 1];
-		A[gid] = (A[gid] * (1 << BIT_DEPTH)) / max_val;
+		A[gid] = ((ulong)A[gid] * (1 << BIT_DEPTH)) / max_val; //widened so 32 bit histograms can not overflow
 	}
 }
 
 //This is entirely identical to ApplyHistogram_Global
 //There is no need for local memory to be used since each output pixel is set once (map pattern) - no race condition can occur
-kernel void ApplyHistogram(global DATA_TYPE* A, global HIST_TYPE* Hist) {
-	int gid = get_global_id(0);
-	if (gid < IMAGE_SIZE) {
-		HIST_TYPE bin = (A[gid] * NUM_BINS) / (1 << BIT_DEPTH); //if the number of bins is not equivalent to the bit depth's value range, rescale the value
+kernel void ApplyHistogram(global DATA_TYPE* A, global HIST_TYPE* Hist, ulong offset, ulong count) {
+	size_t gid = get_global_id(0);
+	if (gid < PIXEL_COUNT(count)) {
+		gid += offset;
+		HIST_TYPE bin = ((uint)A[gid] * NUM_BINS) / (1 << BIT_DEPTH); //if the number of bins is not equivalent to the bit depth's value range, rescale the value
 		const HIST_TYPE MaxVal = (1 << BIT_DEPTH) - 1;//clamp to prevent overflow
 		A[gid] = min(Hist[bin], MaxVal);
 	}
 
-}
\ No newline at end of file
+}
+//NormalizeHistogram that also emits the mapping as a clamped LUT in the image's own type (256 bytes for uchar, 128KB for ushort)
+//so the apply step reads 1-2 bytes per pixel from a table small enough to keep on chip, instead of a scattered 8 byte read + min
+//the normalised graph goes to Normal rather than back into A -- every group reads the total from A's last bin, so A must not
+//change during the launch
+kernel void NormalizeHistogram_LUT(global const HIST_TYPE* A, global HIST_TYPE* Normal, global DATA_TYPE* Lut) {
+	int gid = get_global_id(0);
+	if (gid < NUM_BINS) {
+		HIST_TYPE max_val = A[NUM_BINS - 1];
+		ulong value = ((ulong)A[gid] * (1 << BIT_DEPTH)) / max_val;
+		Normal[gid] = value;
+		Lut[gid] = (DATA_TYPE)min(value, (ulong)((1 << BIT_DEPTH) - 1));
+	}
+}
+
+//apply with the LUT copied into local memory once per group - grid-stride so the copy is paid once per group rather than once per pixel
+//count is the number of pixels in the channel
+kernel void ApplyLUT_Local(global DATA_TYPE* A, global DATA_TYPE* Lut, local DATA_TYPE* LocalLut, ulong count) {
+	int lid = get_local_id(0);
+	size_t end = get_global_offset(0) + PIXEL_COUNT(count);
+	for (int i = lid; i < NUM_BINS; i += get_local_size(0))
+	{
+		LocalLut[i] = Lut[i];
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (size_t gid = get_global_id(0); gid < end; gid += get_global_size(0)) {
+		uint bin = ((uint)A[gid] * NUM_BINS) / (1 << BIT_DEPTH);
+		A[gid] = LocalLut[bin];
+	}
+}
+
+//for LUTs too big for local memory but within the device's constant buffer limit
+kernel void ApplyLUT_Constant(global DATA_TYPE* A, constant DATA_TYPE* Lut, ulong offset, ulong count) {
+	size_t gid = get_global_id(0);
+	if (gid < PIXEL_COUNT(count)) {
+		gid += offset;
+		uint bin = ((uint)A[gid] * NUM_BINS) / (1 << BIT_DEPTH);
+		A[gid] = Lut[bin];
+	}
+}
+
+//fallback for LUTs that fit neither - still 1-2 bytes per lookup instead of 8 and no clamp
+kernel void ApplyLUT_Global(global DATA_TYPE* A, global DATA_TYPE* Lut, ulong offset, ulong count) {
+	size_t gid = get_global_id(0);
+	if (gid < PIXEL_COUNT(count)) {
+		gid += offset;
+		uint bin = ((uint)A[gid] * NUM_BINS) / (1 << BIT_DEPTH);
+		A[gid] = Lut[bin];
+	}
+}
@@ -0,0 +1,85 @@
+//vectorised versions of the per-pixel kernels - each work-item handles VEC_WIDTH consecutive pixels
+//VEC_WIDTH is passed in by the host alongside NUM_BINS/BIT_DEPTH so the vector types can be built here
+#define CAT_(A, B) A##B
+#define CAT(A, B) CAT_(A, B)
+#define VLOAD CAT(vload, VEC_WIDTH)
+#define VSTORE CAT(vstore, VEC_WIDTH)
+
+//offset is where the channel starts and count is how many pixels it has
+//the last work-item of a channel may only have part of a vector left, so it falls back to scalar accesses
+kernel void createHistogram_Global_Vec(global DATA_TYPE* A, global HIST_TYPE* GlobalHistogram, ulong offset, ulong count) {
+	size_t start = get_global_id(0) * VEC_WIDTH;
+	global DATA_TYPE* Channel = A + offset;
+	if (start + VEC_WIDTH <= count) {
+		DATA_TYPE pixels[VEC_WIDTH];
+		VSTORE(VLOAD(0, Channel + start), 0, pixels); //single wide load, unpacked in private memory
+		for (int i = 0; i < VEC_WIDTH; i++) {
+			HIST_TYPE bin = ((uint)pixels[i] * NUM_BINS) / (1 << BIT_DEPTH);
+			atom_inc(&GlobalHistogram[bin]);
+		}
+	}
+	else {
+		for (size_t i = start; i < count; i++) {//ragged tail
+			HIST_TYPE bin = ((uint)Channel[i] * NUM_BINS) / (1 << BIT_DEPTH);
+			atom_inc(&GlobalHistogram[bin]);
+		}
+	}
+}
+
+kernel void createHistogram_Vec(global DATA_TYPE* A, global HIST_TYPE* GlobalHistogram, local LOCAL_HIST_TYPE* LocalHistogram, ulong offset, ulong count) {
+	int lid = get_local_id(0);
+	size_t start = get_global_id(0) * VEC_WIDTH;
+	global DATA_TYPE* Channel = A + offset;
+	for (int i = lid; i < NUM_BINS; i += get_local_size(0))
+	{
+		//clear local histogram
+		LocalHistogram[i] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE); //sync so that whole local histogram is cleared
+
+	if (start + VEC_WIDTH <= count) {
+		DATA_TYPE pixels[VEC_WIDTH];
+		VSTORE(VLOAD(0, Channel + start), 0, pixels);
+		for (int i = 0; i < VEC_WIDTH; i++) {
+			HIST_TYPE bin = ((uint)pixels[i] * NUM_BINS) / (1 << BIT_DEPTH);
+			atomic_inc(&LocalHistogram[bin]);
+		}
+	}
+	else {
+		for (size_t i = start; i < count; i++) {//ragged tail
+			HIST_TYPE bin = ((uint)Channel[i] * NUM_BINS) / (1 << BIT_DEPTH);
+			atomic_inc(&LocalHistogram[bin]);
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE); //sync for local histogram to complete
+
+	for (int i = lid; i < NUM_BINS; i += get_local_size(0))
+	{
+		if (LocalHistogram[i] != 0)
+			atom_add(&GlobalHistogram[i], (HIST_TYPE)LocalHistogram[i]);
+	}
+}
+
+//the apply step is a pure map, so the lookups are done per pixel but the image is read and written a vector at a time
+//shared by the global and local vectorised pipelines
+kernel void ApplyHistogram_Vec(global DATA_TYPE* A, global HIST_TYPE* Hist, ulong offset, ulong count) {
+	size_t start = get_global_id(0) * VEC_WIDTH;
+	global DATA_TYPE* Channel = A + offset;
+	const HIST_TYPE MaxVal = (1 << BIT_DEPTH) - 1;//clamp to prevent overflow
+	if (start + VEC_WIDTH <= count) {
+		DATA_TYPE pixels[VEC_WIDTH];
+		VSTORE(VLOAD(0, Channel + start), 0, pixels);
+		for (int i = 0; i < VEC_WIDTH; i++) {
+			HIST_TYPE bin = ((uint)pixels[i] * NUM_BINS) / (1 << BIT_DEPTH);
+			pixels[i] = min(Hist[bin], MaxVal);
+		}
+		VSTORE(VLOAD(0, pixels), 0, Channel + start);
+	}
+	else {
+		for (size_t i = start; i < count; i++) {//ragged tail
+			HIST_TYPE bin = ((uint)Channel[i] * NUM_BINS) / (1 << BIT_DEPTH);
+			Channel[i] = min(Hist[bin], MaxVal);
+		}
+	}
+}